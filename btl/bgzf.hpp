@@ -0,0 +1,577 @@
+// btl/bgzf.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file bgzf.hpp \brief BGZF (blocked gzip, SAM/BAM specification
+/// section 4.1) reading and writing through std::streambuf, so that
+/// BGZF files work with every stream based function (read_fasta,
+/// write_fasta, record_reader, ...). Blocks are (de)compressed in
+/// parallel on a thread pool. Requires linking with zlib (-lz).
+
+#include "../btl.h"
+#include "../thread/thread_pool.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+
+#include <zlib.h>
+
+#ifndef _BTL_BGZF_
+#define _BTL_BGZF_
+
+BTL_DEFAULT_NAMESPACE_BEGIN
+
+/// \brief Maximum uncompressed payload of a block, chosen (as htslib
+/// does) so that the compressed block always fits in 64KiB.
+constexpr size_t bgzf_max_block_data = 0xff00;
+constexpr size_t bgzf_max_block_size = 0x10000;
+
+/// \brief The empty block marking the end of a BGZF file.
+inline const std::string&
+bgzf_eof_block() {
+  static const std::string eof(
+    "\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff\x06\x00\x42\x43\x02\x00"
+    "\x1b\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00", 28);
+  return eof;
+}
+
+inline void
+bgzf_put16(unsigned char* p, uint32_t v) {
+  p[0] = v & 0xff; p[1] = (v >> 8) & 0xff;
+}
+
+inline void
+bgzf_put32(unsigned char* p, uint32_t v) {
+  for (int i = 0; i < 4; ++i) { p[i] = (v >> (8 * i)) & 0xff; }
+}
+
+inline uint32_t
+bgzf_get16(const unsigned char* p) {
+  return p[0] | (static_cast<uint32_t>(p[1]) << 8);
+}
+
+inline uint32_t
+bgzf_get32(const unsigned char* p) {
+  return p[0] | (static_cast<uint32_t>(p[1]) << 8)
+    | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+/// \brief Compresses n <= bgzf_max_block_data bytes into a complete
+/// BGZF block stored in out.
+inline void
+bgzf_compress_block(const char* src, size_t n, std::string& out,
+                    int level = Z_DEFAULT_COMPRESSION) {
+  out.resize(bgzf_max_block_size);
+  unsigned char* o = reinterpret_cast<unsigned char*>(&out[0]);
+  static const unsigned char header[18] = { 0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff,
+                                            0x06, 0x00, 'B', 'C', 0x02, 0x00, 0, 0 };
+  std::memcpy(o, header, 18);
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw std::runtime_error("bgzf: deflateInit2 failed");
+  }
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(src));
+  zs.avail_in = static_cast<uInt>(n);
+  zs.next_out = o + 18;
+  zs.avail_out = static_cast<uInt>(bgzf_max_block_size - 18 - 8);
+  int ret = deflate(&zs, Z_FINISH);
+  size_t clen = zs.total_out;
+  deflateEnd(&zs);
+  if (ret != Z_STREAM_END) {
+    throw std::runtime_error("bgzf: block does not fit");
+  }
+  size_t total = 18 + clen + 8;
+  bgzf_put16(o + 16, static_cast<uint32_t>(total - 1));
+  uint32_t crc = crc32(0L, reinterpret_cast<const Bytef*>(src), static_cast<uInt>(n));
+  bgzf_put32(o + 18 + clen, crc);
+  bgzf_put32(o + 18 + clen + 4, static_cast<uint32_t>(n));
+  out.resize(total);
+}
+
+/// \brief Decompresses the complete BGZF block [blk, blk + size) into
+/// out (resized to the payload size) and checks its CRC.
+inline void
+bgzf_decompress_block(const char* blk, size_t size, size_t header_size, std::string& out) {
+  const unsigned char* b = reinterpret_cast<const unsigned char*>(blk);
+  uint32_t isize = bgzf_get32(b + size - 4);
+  uint32_t crc = bgzf_get32(b + size - 8);
+  if (isize > bgzf_max_block_size) {
+    throw std::runtime_error("bgzf: corrupted block");
+  }
+  out.resize(isize);
+  if (isize == 0) {
+    return;
+  }
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, -15) != Z_OK) {
+    throw std::runtime_error("bgzf: inflateInit2 failed");
+  }
+  zs.next_in = const_cast<Bytef*>(b + header_size);
+  zs.avail_in = static_cast<uInt>(size - header_size - 8);
+  zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+  zs.avail_out = isize;
+  int ret = inflate(&zs, Z_FINISH);
+  inflateEnd(&zs);
+  if (ret != Z_STREAM_END || zs.total_out != isize) {
+    throw std::runtime_error("bgzf: corrupted block");
+  }
+  if (crc32(0L, reinterpret_cast<const Bytef*>(out.data()), isize) != crc) {
+    throw std::runtime_error("bgzf: CRC mismatch");
+  }
+}
+
+/// \brief Reads the next raw block from is into blk, returns the size
+/// of the gzip header (0 at end of stream).
+inline size_t
+bgzf_read_raw_block(std::istream& is, std::string& blk) {
+  unsigned char h[12];
+  is.read(reinterpret_cast<char*>(h), 12);
+  if (is.gcount() == 0) {
+    return 0;
+  }
+  if (is.gcount() != 12 || h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || !(h[3] & 4)) {
+    throw std::runtime_error("bgzf: not a BGZF block");
+  }
+  uint32_t xlen = bgzf_get16(h + 10);
+  std::string extra(xlen, '\0');
+  is.read(&extra[0], xlen);
+  uint32_t bsize = 0;
+  const unsigned char* x = reinterpret_cast<const unsigned char*>(extra.data());
+  for (uint32_t i = 0; i + 4 <= xlen; i += 4 + bgzf_get16(x + i + 2)) {
+    if (x[i] == 'B' && x[i + 1] == 'C' && bgzf_get16(x + i + 2) == 2) {
+      bsize = bgzf_get16(x + i + 4) + 1;
+    }
+  }
+  if (bsize == 0 || bsize < 12 + xlen + 8) {
+    throw std::runtime_error("bgzf: missing BC field");
+  }
+  blk.resize(bsize);
+  std::memcpy(&blk[0], h, 12);
+  std::memcpy(&blk[12], extra.data(), xlen);
+  is.read(&blk[12 + xlen], bsize - 12 - xlen);
+  if (static_cast<size_t>(is.gcount()) != bsize - 12 - xlen) {
+    throw std::runtime_error("bgzf: truncated block");
+  }
+  return 12 + xlen;
+}
+
+/// \brief Input stream buffer over a BGZF stream. Up to read_ahead
+/// blocks are read and decompressed in parallel on the pool.
+/// tellg()/seekg() use BGZF virtual offsets (compressed block offset
+/// << 16 | offset in the uncompressed block).
+class bgzf_istreambuf : public std::streambuf
+{
+public:
+  /// \brief n_threads == 1 decompresses on the reading thread, 0 means
+  /// hardware concurrency.
+  explicit bgzf_istreambuf(std::istream& is, size_t n_threads = 1, size_t read_ahead = 0)
+    : _is {is}, _pool {nullptr}, _coffset {0}, _next_coffset {0}
+  {
+    if (n_threads != 1) {
+      _own_pool.reset(new ctl::thread_pool(n_threads));
+      _pool = _own_pool.get();
+    }
+    _ahead = read_ahead ? read_ahead : (_pool ? 4 * _pool->size() : 1);
+    _next_coffset = start_offset();
+    setg(nullptr, nullptr, nullptr);
+  }
+
+  /// \brief Uses an external pool.
+  bgzf_istreambuf(std::istream& is, ctl::thread_pool& pool, size_t read_ahead = 0)
+    : _is {is}, _pool {&pool}, _coffset {0}, _next_coffset {0}
+  {
+    _ahead = read_ahead ? read_ahead : 4 * _pool->size();
+    _next_coffset = start_offset();
+    setg(nullptr, nullptr, nullptr);
+  }
+
+  ~bgzf_istreambuf() { drain(); }
+
+  uint64_t
+  tell_virtual() const {
+    return (_coffset << 16) | static_cast<uint64_t>(gptr() - eback());
+  }
+
+  void
+  seek_virtual(uint64_t voff) {
+    drain();
+    _is.clear();
+    _is.seekg(static_cast<std::streamoff>(voff >> 16));
+    _next_coffset = voff >> 16;
+    setg(nullptr, nullptr, nullptr);
+    _current.reset();
+    if (underflow() == traits_type::eof()) {
+      return;
+    }
+    size_t u = static_cast<size_t>(voff & 0xffff);
+    setg(eback(), eback() + std::min<size_t>(u, egptr() - eback()), egptr());
+  }
+
+protected:
+  int_type
+  underflow() override {
+    if (gptr() < egptr()) {
+      return traits_type::to_int_type(*gptr());
+    }
+    while (true) {
+      fill();
+      if (_queue.empty()) {
+        return traits_type::eof();
+      }
+      _current = std::move(_queue.front());
+      _queue.pop_front();
+      if (_current->done.valid()) {
+        _current->done.get();
+      }
+      _coffset = _current->coffset;
+      if (!_current->data.empty()) {
+        char* b = &_current->data[0];
+        setg(b, b, b + _current->data.size());
+        return traits_type::to_int_type(*b);
+      }
+    }
+  }
+
+  pos_type
+  seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override {
+    if (off == 0 && dir == std::ios_base::cur) {
+      return pos_type(static_cast<off_type>(tell_virtual()));
+    }
+    return pos_type(off_type(-1));
+  }
+
+  pos_type
+  seekpos(pos_type pos, std::ios_base::openmode) override {
+    seek_virtual(static_cast<uint64_t>(static_cast<off_type>(pos)));
+    return pos;
+  }
+
+private:
+  struct block
+  {
+    uint64_t coffset;
+    size_t header;
+    std::string raw;
+    std::string data;
+    std::future<void> done;
+  };
+
+  std::istream& _is;
+  std::unique_ptr<ctl::thread_pool> _own_pool;
+  ctl::thread_pool* _pool;
+  size_t _ahead;
+  uint64_t _coffset;
+  uint64_t _next_coffset;
+  std::deque<std::unique_ptr<block>> _queue;
+  std::unique_ptr<block> _current;
+
+  uint64_t
+  start_offset() {
+    std::streamoff p = _is.tellg();
+    if (p < 0) {
+      _is.clear();
+      return 0;
+    }
+    return static_cast<uint64_t>(p);
+  }
+
+  void
+  fill() {
+    while (_queue.size() < _ahead && _is) {
+      std::unique_ptr<block> b(new block);
+      b->coffset = _next_coffset;
+      b->header = bgzf_read_raw_block(_is, b->raw);
+      if (b->header == 0) {
+        break;
+      }
+      _next_coffset += b->raw.size();
+      block* p = b.get();
+      if (_pool) {
+        p->done = _pool->submit([p]() {
+          bgzf_decompress_block(p->raw.data(), p->raw.size(), p->header, p->data);
+        });
+      } else {
+        bgzf_decompress_block(p->raw.data(), p->raw.size(), p->header, p->data);
+      }
+      _queue.push_back(std::move(b));
+    }
+  }
+
+  void
+  drain() {
+    for (auto& b : _queue) {
+      if (b->done.valid()) {
+        b->done.wait();
+      }
+    }
+    _queue.clear();
+  }
+};
+
+/// \brief Output stream buffer writing BGZF. Every full block is
+/// handed to the pool as soon as it is filled, compressed blocks are
+/// written in order while further blocks are being filled; at most
+/// max_pending blocks are in flight. close() (or destruction) appends
+/// the EOF marker block.
+class bgzf_ostreambuf : public std::streambuf
+{
+public:
+  explicit bgzf_ostreambuf(std::ostream& os, size_t n_threads = 1,
+                           int level = Z_DEFAULT_COMPRESSION, size_t max_pending = 0)
+    : _os {os}, _pool {nullptr}, _level {level}, _closed {false}, _failed {false}
+  {
+    if (n_threads != 1) {
+      _own_pool.reset(new ctl::thread_pool(n_threads));
+      _pool = _own_pool.get();
+    }
+    _max_pending = max_pending ? max_pending : (_pool ? 4 * _pool->size() : 1);
+    reset_buffer();
+  }
+
+  bgzf_ostreambuf(std::ostream& os, ctl::thread_pool& pool,
+                  int level = Z_DEFAULT_COMPRESSION, size_t max_pending = 0)
+    : _os {os}, _pool {&pool}, _level {level}, _closed {false}, _failed {false}
+  {
+    _max_pending = max_pending ? max_pending : 4 * _pool->size();
+    reset_buffer();
+  }
+
+  ~bgzf_ostreambuf() {
+    try {
+      close();
+    } catch (...) {
+    }
+  }
+
+  /// \brief Writes the pending blocks and the EOF marker. If a block
+  /// failed (now or in an earlier write) an exception is thrown and no
+  /// EOF marker is written, so that the output is not mistaken for a
+  /// complete file.
+  void
+  close() {
+    if (_closed) {
+      return;
+    }
+    try {
+      emit();
+      write_pending(0);
+    } catch (...) {
+      _closed = true;
+      throw;
+    }
+    if (_failed) {
+      _closed = true;
+      throw std::runtime_error("bgzf: a block could not be compressed, output is incomplete");
+    }
+    _os.write(bgzf_eof_block().data(), bgzf_eof_block().size());
+    _os.flush();
+    _closed = true;
+  }
+
+protected:
+  int_type
+  overflow(int_type c) override {
+    emit();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize
+  xsputn(const char* s, std::streamsize n) override {
+    std::streamsize done = 0;
+    while (done < n) {
+      std::streamsize room = epptr() - pptr();
+      if (room == 0) {
+        emit();
+        continue;
+      }
+      std::streamsize c = std::min(room, n - done);
+      std::memcpy(pptr(), s + done, c);
+      pbump(static_cast<int>(c));
+      done += c;
+    }
+    return n;
+  }
+
+  int
+  sync() override {
+    emit();
+    write_pending(0);
+    _os.flush();
+    return _os ? 0 : -1;
+  }
+
+private:
+  struct block
+  {
+    std::string data;
+    std::string comp;
+    std::future<void> done;
+  };
+
+  // the blocks are declared before the pool, so that an owned pool
+  // joins its workers before the blocks they point to are freed
+  std::ostream& _os;
+  std::unique_ptr<block> _filling;
+  std::deque<std::unique_ptr<block>> _pending;
+  std::unique_ptr<ctl::thread_pool> _own_pool;
+  ctl::thread_pool* _pool;
+  int _level;
+  size_t _max_pending;
+  bool _closed;
+  bool _failed;
+
+  void
+  reset_buffer() {
+    _filling.reset(new block);
+    _filling->data.resize(bgzf_max_block_data);
+    char* b = &_filling->data[0];
+    setp(b, b + bgzf_max_block_data);
+  }
+
+  void
+  emit() {
+    size_t n = pptr() - pbase();
+    if (n == 0) {
+      return;
+    }
+    if (_failed) {
+      // the output is already incomplete, discard the data
+      setp(pbase(), epptr());
+      return;
+    }
+    _filling->data.resize(n);
+    block* p = _filling.get();
+    int level = _level;
+    if (_pool) {
+      p->done = _pool->submit([p, level]() {
+        bgzf_compress_block(p->data.data(), p->data.size(), p->comp, level);
+      });
+    } else {
+      bgzf_compress_block(p->data.data(), p->data.size(), p->comp, level);
+    }
+    _pending.push_back(std::move(_filling));
+    // a fresh put area first, write_pending may throw and drop p
+    reset_buffer();
+    write_pending(_max_pending);
+  }
+
+  // writes the oldest blocks until keep are left; on failure every
+  // queued task is waited for and the pending blocks are dropped, since
+  // the tasks reference them
+  void
+  write_pending(size_t keep) {
+    try {
+      while (_pending.size() > keep) {
+        auto& b = _pending.front();
+        if (b->done.valid()) {
+          b->done.get();
+        }
+        _os.write(b->comp.data(), b->comp.size());
+        _pending.pop_front();
+      }
+    } catch (...) {
+      for (auto& b : _pending) {
+        if (b->done.valid()) {
+          b->done.wait();
+        }
+      }
+      _pending.clear();
+      _failed = true;
+      throw;
+    }
+  }
+};
+
+/// \brief std::istream reading a BGZF file.
+class bgzf_ifstream : public std::istream
+{
+public:
+  explicit bgzf_ifstream(const std::string& path, size_t n_threads = 1)
+    : std::istream(nullptr), _file(path, std::ios::binary), _buf(_file, n_threads)
+  {
+    rdbuf(&_buf);
+    if (!_file) {
+      setstate(std::ios::failbit);
+    }
+  }
+
+  uint64_t tell_virtual() const { return _buf.tell_virtual(); }
+  void seek_virtual(uint64_t v) { clear(); _buf.seek_virtual(v); }
+
+private:
+  std::ifstream _file;
+  bgzf_istreambuf _buf;
+};
+
+/// \brief std::ostream writing a BGZF file.
+class bgzf_ofstream : public std::ostream
+{
+public:
+  explicit bgzf_ofstream(const std::string& path, size_t n_threads = 1,
+                         int level = Z_DEFAULT_COMPRESSION)
+    : std::ostream(nullptr), _file(path, std::ios::binary), _buf(_file, n_threads, level)
+  {
+    rdbuf(&_buf);
+    if (!_file) {
+      setstate(std::ios::failbit);
+    }
+  }
+
+  ~bgzf_ofstream() { close(); }
+
+  void close() { _buf.close(); }
+
+private:
+  std::ofstream _file;
+  bgzf_ostreambuf _buf;
+};
+
+/// \brief True if the file at path starts with a BGZF block header.
+inline bool
+is_bgzf(const std::string& path) {
+  std::ifstream is(path, std::ios::binary);
+  unsigned char h[16];
+  is.read(reinterpret_cast<char*>(h), 16);
+  return is.gcount() == 16 && h[0] == 0x1f && h[1] == 0x8b && (h[3] & 4)
+    && h[12] == 'B' && h[13] == 'C';
+}
+
+/// \brief Opens path as a plain or BGZF compressed input stream.
+inline std::unique_ptr<std::istream>
+open_sequence_input(const std::string& path, size_t n_threads = 1) {
+  if (is_bgzf(path)) {
+    return std::unique_ptr<std::istream>(new bgzf_ifstream(path, n_threads));
+  }
+  return std::unique_ptr<std::istream>(new std::ifstream(path, std::ios::binary));
+}
+
+BTL_DEFAULT_NAMESPACE_END
+
+#endif
@@ -16,11 +16,18 @@
 
 #include "../btl.h"
 
+#include "../data_structure/packed_dna.hpp"
+#include "../rand/philox.hpp"
 #include "../rand/random_sequence.hpp"
 #include "../str/kmer.hpp"
+#include "markov.hpp"
 
 #include <map>
 #include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 #ifndef _BTL_GENERATOR_
 #define _BTL_GENERATOR_
@@ -31,11 +38,17 @@ template <typename _ContT, typename _DistT, typename _RandDev>
 _ContT
 random_genome(size_t G, _DistT dist, _RandDev& rdev,
 	      const std::string alphabet = "ACGT") {
-  _ContT genome; 
   auto gen =
     ctl::make_sequence_distribution<char, std::string, _DistT>(alphabet, dist);
-  gen(G, std::inserter(genome, genome.end()), rdev);
-  return genome;
+  if constexpr (std::is_same<_ContT, std::string>::value ||
+                std::is_same<_ContT, std::vector<char>>::value) {
+    // contiguous storage: fill the buffer in bulk
+    return gen.template sequence<_ContT>(G, rdev);
+  } else {
+    _ContT genome;
+    gen(G, std::inserter(genome, genome.end()), rdev);
+    return genome;
+  }
 }
 
 template <typename DistT_, typename RandDev_>
@@ -44,17 +57,108 @@ random_genome_string(size_t G, DistT_ dist, RandDev_& rdev) {
   return random_genome<std::string, DistT_, RandDev_>(G, dist, rdev);
 }
 
+/// \brief Generates a genome of size G in parallel blocks. Each block of
+/// block_size bases is drawn from its own philox4x32 stream, hence the
+/// output is bit-identical for a given seed whatever n_threads is.
+template <typename _DistT>
+std::string
+random_genome_parallel(size_t G, _DistT dist, uint64_t seed, size_t n_threads = 0,
+                       const std::string alphabet = "ACGT",
+                       size_t block_size = size_t(1) << 16) {
+  auto gen =
+    ctl::make_sequence_distribution<char, std::string, _DistT>(alphabet, dist);
+  std::string genome(G, '\0');
+  if (G > 0) {
+    ctl::parallel_generate(&genome[0], G, seed,
+                           [gen](char* out, size_t n, ctl::philox4x32& rng) mutable {
+                             gen(out, n, rng);
+                           }, n_threads, block_size);
+  }
+  return genome;
+}
+
+/// \brief Generates a genome of size G directly in 2 bit packed form.
+/// The alphabet must only contain A, C, G and T (std::invalid_argument
+/// otherwise). With a uniform distribution over the four bases random
+/// words are used as packed words directly, skewed distributions are
+/// converted a block of words at a time through the alias table.
+template <typename _DistT, typename _RandDev>
+ctl::packed_dna
+random_genome_packed(size_t G, _DistT dist, _RandDev& rdev,
+                     const std::string alphabet = "ACGT") {
+  ctl::alias_table<uint32_t> at(dist.begin(), dist.end());
+  if (at.size() != alphabet.size() || alphabet.size() > 256) {
+    throw std::invalid_argument("random_genome_packed: alphabet and distribution sizes differ");
+  }
+  uint8_t code_of[256];
+  for (size_t i = 0; i < alphabet.size(); ++i) {
+    code_of[i] = ctl::nucleotide_code(alphabet[i]);
+    if (code_of[i] == ctl::nucleotide_invalid) {
+      throw std::invalid_argument("random_genome_packed: alphabet must be over ACGT");
+    }
+  }
+  bool identity = (alphabet.size() == 4);
+  for (size_t i = 0; identity && i < 4; ++i) {
+    identity = (code_of[i] == i);
+  }
+
+  ctl::packed_dna genome(G);
+  uint64_t* out = genome.data();
+  const size_t n_words = genome.word_count();
+  if (identity && at.is_uniform()) {
+    for (size_t w = 0; w < n_words; ++w) {
+      out[w] = ctl::random_word64(rdev);
+    }
+  } else {
+    constexpr size_t block = 256;
+    const unsigned lanes = at.lanes_per_word();
+    uint64_t rnd[block];
+    uint8_t codes[block * 2];
+    size_t w = 0;
+    while (w < n_words) {
+      // number of output words filled by this block of random words
+      size_t n_out = std::min((block * lanes) / ctl::packed_dna_bases_per_word, n_words - w);
+      size_t n_rnd = (n_out * ctl::packed_dna_bases_per_word) / lanes;
+      for (size_t i = 0; i < n_rnd; ++i) {
+        rnd[i] = ctl::random_word64(rdev);
+      }
+      at.convert(rnd, n_rnd, codes);
+      if (!identity) {
+        for (size_t i = 0; i < n_rnd * lanes; ++i) {
+          codes[i] = code_of[codes[i]];
+        }
+      }
+      for (size_t i = 0; i < n_out; ++i) {
+        out[w + i] = ctl::pack_codes32(codes + i * ctl::packed_dna_bases_per_word);
+      }
+      w += n_out;
+    }
+  }
+  genome.trim();
+  return genome;
+}
+
 template <typename _ContT, typename _RandDev>
 _ContT
 random_like(const _ContT& src, _RandDev& rdev) {
   std::size_t n = std::distance(src.begin(), src.end());
-  std::map<std::string,std::size_t> map;
-  ctl::kmer_statistics(src, 1, map);
+  std::vector<std::size_t> dist;
+  ctl::kmer_code_statistics(src, 1, dist);
   // TODO: use the argument alphabet of 'random_genome'
-  std::vector<std::size_t> dist { map["A"], map["C"], map["G"], map["T"] };
   return random_genome<_ContT, std::vector<std::size_t>, _RandDev>(n, dist, rdev);
 }
 
+/// \brief Generates a sequence as long as src from an order-k Markov
+/// model trained on src (order 0 is equivalent to random_like above).
+template <typename _ContT, typename _RandDev>
+_ContT
+random_like(const _ContT& src, _RandDev& rdev, size_t order) {
+  std::size_t n = std::distance(src.begin(), src.end());
+  markov_model model = make_markov_model(src, order);
+  std::string s = model.sample(n, rdev);
+  return _ContT(s.begin(), s.end());
+}
+
 BTL_DEFAULT_NAMESPACE_END
 
 #endif
@@ -15,10 +15,31 @@
 // limitations under the License.
 
 #include "../btl.h"
+#include "../io/mapped_file.hpp"
+#include "../str/nucleotide.hpp"
+#include "../thread/thread_pool.hpp"
+#include "../util/instrument.hpp"
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <string>
+#include <string_view>
+#include <sstream>
 #include <fstream>
+#include <vector>
 
 #ifndef _BTL_IO_
 #define _BTL_IO_
@@ -33,8 +54,10 @@ template <typename _StreamT>
 std::pair<std::string, std::string>
 read_fasta(_StreamT& is)
 {
+  CTL_INSTRUMENT_SCOPE("read_fasta");
   std::string header { "" };
   std::string genome { "" };
+  CTL_INSTRUMENT_ONLY(uint64_t lines = 0;)
 
   if (is) {
     std::getline(is, header);
@@ -44,7 +67,10 @@ read_fasta(_StreamT& is)
     std::string tmp { "" };
     std::getline(is, tmp);
     genome.append(tmp);
+    CTL_INSTRUMENT_ONLY(++lines;)
   }
+  CTL_INSTRUMENT_COUNT("read_fasta_records", header.empty() ? 0 : 1);
+  CTL_INSTRUMENT_COUNT("read_fasta_bytes", header.size() + genome.size() + lines);
 
   return std::make_pair(std::move(header), std::move(genome));
 }
@@ -58,21 +84,1468 @@ read_fasta(std::string& path) {
   return pp;
 }
 
+/// \brief A FASTA or FASTQ record (qual is empty for FASTA). The name
+/// is the header up to the first blank, the rest goes in comment.
+struct sequence_record
+{
+  std::string name;
+  std::string comment;
+  std::string seq;
+  std::string qual;
+
+  void
+  clear() {
+    name.clear();
+    comment.clear();
+    seq.clear();
+    qual.clear();
+  }
+};
+
+// Appends the range [b, e) to out wrapping lines at max_line
+// characters (0 means no wrapping), every line is terminated by '\n'.
+// Contiguous ranges are copied a whole line at a time.
+template <typename _IterT>
+void
+append_wrapped(std::string& out, _IterT b, _IterT e, size_t max_line) {
+  if (b == e) {
+    return;
+  }
+  if constexpr (std::is_pointer<_IterT>::value
+                || std::is_same<_IterT, std::string::const_iterator>::value
+                || std::is_same<_IterT, std::string::iterator>::value
+                || std::is_same<_IterT, std::vector<char>::const_iterator>::value
+                || std::is_same<_IterT, std::vector<char>::iterator>::value) {
+    const char* p = &*b;
+    size_t n = static_cast<size_t>(e - b);
+    size_t line = max_line ? max_line : n;
+    out.reserve(out.size() + n + n / line + 1);
+    for (size_t i = 0; i < n; i += line) {
+      size_t c = std::min(line, n - i);
+      out.append(p + i, c);
+      out.push_back('\n');
+    }
+  } else {
+    size_t i = 0;
+    for (; b != e; ++b) {
+      out.push_back(*b);
+      if (max_line && (++i % max_line) == 0) {
+        out.push_back('\n');
+      }
+    }
+    if (!max_line || (i % max_line) != 0) {
+      out.push_back('\n');
+    }
+  }
+}
+
+// Writes h (as is, read_fasta keeps the '>' in the header) followed by
+// the sequence g wrapped at max_line characters per line.
 template <typename _StreamT, typename _ContT, typename _HeadT>
 void
 write_fasta(_StreamT& os, const _ContT& g, const 
 	    _HeadT& h, size_t max_line=50) {
   os << h << "\n";
-  auto b = g.begin();
-  auto e = g.end();
-  for (size_t i = 1; b != e; ++b, ++i) {
-    os << *b;
-    if ( (i % max_line) == 0) { std::cout << "\n"; }
+  std::string buf;
+  append_wrapped(buf, g.begin(), g.end(), max_line);
+  os.write(buf.data(), buf.size());
+}
+
+// Writes a four line FASTQ record, '@' is prepended to h unless
+// already present.
+template <typename _StreamT, typename _ContT, typename _QualT, typename _HeadT>
+void
+write_fastq(_StreamT& os, const _ContT& g, const _QualT& q, const _HeadT& h) {
+  std::string buf;
+  std::string head(h);
+  if (head.empty() || head[0] != '@') {
+    buf.push_back('@');
   }
+  buf += head;
+  buf.push_back('\n');
+  append_wrapped(buf, g.begin(), g.end(), 0);
+  buf += "+\n";
+  append_wrapped(buf, q.begin(), q.end(), 0);
+  os.write(buf.data(), buf.size());
 }
 
+/// \brief Buffered FASTA/FASTQ writer. Records are formatted into a
+/// large buffer; when it is full the buffer is handed to a background
+/// thread that writes it to the stream while formatting continues in a
+/// second buffer. Call close() (or destroy the writer) to flush.
+template <typename _StreamT>
+class sequence_writer
+{
+public:
+  explicit sequence_writer(_StreamT& os, size_t buffer_size = size_t(1) << 22,
+                           bool background = true, size_t max_line = 60)
+    : _os {os}, _size {buffer_size}, _background {background},
+      _max_line {max_line}, _busy {false}, _stop {false}
+  {
+    _buf.reserve(_size + _size / 8);
+    if (_background) {
+      _thread = std::thread([this]() { writer(); });
+    }
+  }
+
+  sequence_writer(const sequence_writer&) = delete;
+  sequence_writer& operator=(const sequence_writer&) = delete;
+
+  ~sequence_writer() { close(); }
+
+  /// \brief Writes '>' + header and the wrapped sequence.
+  template <typename _ContT>
+  void
+  write_fasta(const std::string& header, const _ContT& seq) {
+    put_header('>', header, std::string());
+    append_wrapped(_buf, seq.begin(), seq.end(), _max_line);
+    maybe_flush();
+  }
+
+  /// \brief Writes '@' + header, sequence, '+' and quality lines.
+  template <typename _ContT, typename _QualT>
+  void
+  write_fastq(const std::string& header, const _ContT& seq, const _QualT& qual) {
+    put_header('@', header, std::string());
+    put_fastq_body(seq, qual);
+  }
+
+  /// \brief Writes a sequence_record as FASTQ if it has qualities,
+  /// as FASTA otherwise.
+  void
+  write(const sequence_record& r) {
+    if (r.qual.empty()) {
+      put_header('>', r.name, r.comment);
+      append_wrapped(_buf, r.seq.begin(), r.seq.end(), _max_line);
+      maybe_flush();
+    } else {
+      put_header('@', r.name, r.comment);
+      put_fastq_body(r.seq, r.qual);
+    }
+  }
+
+  /// \brief Writes everything buffered so far and waits for completion.
+  void
+  flush() {
+    hand_over();
+    if (_background) {
+      std::unique_lock<std::mutex> lk(_m);
+      _cv.wait(lk, [this]() { return !_busy; });
+    }
+    _os.flush();
+  }
+
+  void
+  close() {
+    if (_stop) {
+      return;
+    }
+    flush();
+    if (_background) {
+      {
+        std::lock_guard<std::mutex> lk(_m);
+        _stop = true;
+      }
+      _cv.notify_all();
+      _thread.join();
+    }
+    _stop = true;
+  }
+
+private:
+  _StreamT& _os;
+  size_t _size;
+  bool _background;
+  size_t _max_line;
+  std::string _buf;
+  std::string _out;
+  bool _busy;
+  bool _stop;
+  std::mutex _m;
+  std::condition_variable _cv;
+  std::thread _thread;
+
+  void
+  put_header(char tag, const std::string& name, const std::string& comment) {
+    _buf.push_back(tag);
+    _buf += name;
+    if (!comment.empty()) {
+      _buf.push_back(' ');
+      _buf += comment;
+    }
+    _buf.push_back('\n');
+  }
+
+  template <typename _ContT, typename _QualT>
+  void
+  put_fastq_body(const _ContT& seq, const _QualT& qual) {
+    append_wrapped(_buf, seq.begin(), seq.end(), 0);
+    _buf += "+\n";
+    append_wrapped(_buf, qual.begin(), qual.end(), 0);
+    maybe_flush();
+  }
+
+  void
+  maybe_flush() {
+    if (_buf.size() >= _size) {
+      hand_over();
+    }
+  }
+
+  void
+  hand_over() {
+    if (_buf.empty()) {
+      return;
+    }
+    if (!_background) {
+      _os.write(_buf.data(), _buf.size());
+      _buf.clear();
+      return;
+    }
+    std::unique_lock<std::mutex> lk(_m);
+    _cv.wait(lk, [this]() { return !_busy; });
+    _out.swap(_buf);
+    _buf.clear();
+    _busy = true;
+    lk.unlock();
+    _cv.notify_all();
+  }
+
+  void
+  writer() {
+    std::unique_lock<std::mutex> lk(_m);
+    while (true) {
+      _cv.wait(lk, [this]() { return _busy || _stop; });
+      if (_busy) {
+        lk.unlock();
+        _os.write(_out.data(), _out.size());
+        lk.lock();
+        _busy = false;
+        _cv.notify_all();
+        continue;
+      }
+      return;
+    }
+  }
+};
+
 using HeaderGenomePair = std::pair<std::string, std::string>;
 
+/// \brief Source reading from a std::istream (possibly owned, e.g. when
+/// opening a path). Sources provide size_t read(char*, size_t) that
+/// returns 0 only at end of input.
+class istream_source
+{
+public:
+  explicit istream_source(std::istream& is) : _is {&is} { }
+  explicit istream_source(const std::string& path)
+    : _own { new std::ifstream(path, std::ios::binary) }, _is {_own.get()} { }
+
+  size_t
+  read(char* buf, size_t n) {
+    _is->read(buf, n);
+    return static_cast<size_t>(_is->gcount());
+  }
+
+  bool good() const { return static_cast<bool>(*_is) || _is->eof(); }
+
+private:
+  std::unique_ptr<std::istream> _own;
+  std::istream* _is;
+};
+
+/// \brief Reads a source through two large buffers. With prefetch
+/// enabled a background thread fills one buffer while the consumer
+/// works on the other.
+template <typename _SourceT>
+class double_buffered_reader
+{
+public:
+  double_buffered_reader(_SourceT& src, size_t buffer_size = size_t(1) << 22,
+                         bool prefetch = true)
+    : _src {src}, _prefetch {prefetch}, _current {-1}, _stop {false}
+  {
+    for (auto& s : _slots) {
+      s.data.resize(buffer_size);
+      s.size = 0;
+      s.ready = false;
+      s.eof = false;
+    }
+    if (_prefetch) {
+      _thread = std::thread([this]() { producer(); });
+    }
+  }
+
+  double_buffered_reader(const double_buffered_reader&) = delete;
+  double_buffered_reader& operator=(const double_buffered_reader&) = delete;
+
+  ~double_buffered_reader() {
+    if (_prefetch) {
+      {
+        std::lock_guard<std::mutex> lk(_m);
+        _stop = true;
+      }
+      _cv.notify_all();
+      _thread.join();
+    }
+  }
+
+  /// \brief Releases the current chunk and returns the next one, an
+  /// empty chunk means end of input.
+  std::string_view
+  next_chunk() {
+    int next = (_current + 1) % 2;
+    if (!_prefetch) {
+      slot& s = _slots[next];
+      s.size = _src.read(s.data.data(), s.data.size());
+      _current = next;
+      return std::string_view(s.data.data(), s.size);
+    }
+    std::unique_lock<std::mutex> lk(_m);
+    if (_current >= 0) {
+      _slots[_current].ready = false;
+      _cv.notify_all();
+    }
+    _cv.wait(lk, [&]() { return _slots[next].ready; });
+    _current = next;
+    return std::string_view(_slots[next].data.data(), _slots[next].size);
+  }
+
+private:
+  struct slot
+  {
+    std::vector<char> data;
+    size_t size;
+    bool ready;
+    bool eof;
+  };
+
+  _SourceT& _src;
+  bool _prefetch;
+  slot _slots[2];
+  int _current;
+  bool _stop;
+  std::mutex _m;
+  std::condition_variable _cv;
+  std::thread _thread;
+
+  void
+  producer() {
+    int i = 0;
+    bool eof = false;
+    while (true) {
+      slot& s = _slots[i];
+      {
+        std::unique_lock<std::mutex> lk(_m);
+        _cv.wait(lk, [&]() { return _stop || !s.ready; });
+        if (_stop) {
+          return;
+        }
+      }
+      // the slot is not visible to the consumer until ready is set
+      s.size = eof ? 0 : _src.read(s.data.data(), s.data.size());
+      eof = eof || (s.size == 0);
+      {
+        std::lock_guard<std::mutex> lk(_m);
+        s.ready = true;
+      }
+      _cv.notify_all();
+      i = (i + 1) % 2;
+    }
+  }
+};
+
+/// \brief Record by record reader of FASTA and FASTQ (detected from
+/// the first character) over a double_buffered_reader. next() reuses
+/// the storage of the record passed in, so a loop over a whole file
+/// does not allocate once the strings have grown to the longest record.
+template <typename _SourceT>
+class record_reader
+{
+public:
+  explicit record_reader(_SourceT& src, size_t buffer_size = size_t(1) << 22,
+                         bool prefetch = true)
+    : _in(src, buffer_size, prefetch), _p {nullptr}, _e {nullptr}, _eof {false} { }
+
+  bool
+  next(sequence_record& r) {
+    r.clear();
+    int c = peek();
+    while (c == '\n' || c == '\r') {
+      ++_p;
+      c = peek();
+    }
+    if (c == '>') {
+      return next_fasta(r);
+    }
+    if (c == '@') {
+      return next_fastq(r);
+    }
+    return false;
+  }
+
+  class iterator
+  {
+  public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef sequence_record value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const sequence_record* pointer;
+    typedef const sequence_record& reference;
+
+    iterator() : _r {nullptr} { }
+    explicit iterator(record_reader* r) : _r {r} { ++(*this); }
+
+    reference operator*() const { return _rec; }
+    pointer operator->() const { return &_rec; }
+    iterator& operator++() { if (_r && !_r->next(_rec)) { _r = nullptr; } return *this; }
+    bool operator==(const iterator& o) const { return _r == o._r; }
+    bool operator!=(const iterator& o) const { return _r != o._r; }
+
+  private:
+    record_reader* _r;
+    sequence_record _rec;
+  };
+
+  iterator begin() { return iterator(this); }
+  iterator end() { return iterator(); }
+
+private:
+  double_buffered_reader<_SourceT> _in;
+  const char* _p;
+  const char* _e;
+  bool _eof;
+  std::string _line;
+
+  int
+  peek() {
+    while (_p == _e) {
+      if (_eof) {
+        return -1;
+      }
+      std::string_view c = _in.next_chunk();
+      if (c.empty()) {
+        _eof = true;
+        return -1;
+      }
+      _p = c.data();
+      _e = c.data() + c.size();
+    }
+    return static_cast<unsigned char>(*_p);
+  }
+
+  // appends the rest of the current line (without terminator) to out
+  bool
+  read_line(std::string& out) {
+    bool any = false;
+    while (peek() >= 0) {
+      any = true;
+      const char* nl = static_cast<const char*>(std::memchr(_p, '\n', _e - _p));
+      if (nl) {
+        out.append(_p, nl - _p);
+        _p = nl + 1;
+        break;
+      }
+      out.append(_p, _e - _p);
+      _p = _e;
+    }
+    if (!out.empty() && out.back() == '\r') {
+      out.pop_back();
+    }
+    return any;
+  }
+
+  void
+  split_header(sequence_record& r) {
+    size_t sp = _line.find_first_of(" \t", 1);
+    if (sp == std::string::npos) {
+      r.name.assign(_line, 1, std::string::npos);
+    } else {
+      r.name.assign(_line, 1, sp - 1);
+      r.comment.assign(_line, sp + 1, std::string::npos);
+    }
+  }
+
+  bool
+  next_fasta(sequence_record& r) {
+    _line.clear();
+    read_line(_line);
+    split_header(r);
+    for (int c = peek(); c >= 0 && c != '>'; c = peek()) {
+      read_line(r.seq);
+    }
+    return true;
+  }
+
+  bool
+  next_fastq(sequence_record& r) {
+    _line.clear();
+    read_line(_line);
+    split_header(r);
+    for (int c = peek(); c >= 0 && c != '+'; c = peek()) {
+      read_line(r.seq);
+    }
+    _line.clear();
+    read_line(_line);
+    while (r.qual.size() < r.seq.size() && read_line(r.qual)) { }
+    return true;
+  }
+};
+
+/// \brief Parses all FASTA/FASTQ records in [b, e) (that must start on
+/// a record boundary) appending them to out.
+inline void
+parse_records(const char* b, const char* e, std::vector<sequence_record>& out) {
+  auto line_end = [e](const char* p) {
+    const char* nl = static_cast<const char*>(std::memchr(p, '\n', e - p));
+    return nl ? nl : e;
+  };
+  auto append = [](std::string& s, const char* p, const char* le) {
+    s.append(p, ((le > p && *(le - 1) == '\r') ? le - 1 : le) - p);
+  };
+  const char* p = b;
+  while (p < e) {
+    if (*p != '>' && *p != '@') {
+      p = line_end(p) + 1;
+      continue;
+    }
+    out.emplace_back();
+    sequence_record& r = out.back();
+    const char* le = line_end(p);
+    std::string h;
+    append(h, p + 1, le);
+    size_t sp = h.find_first_of(" \t");
+    r.name = h.substr(0, sp);
+    if (sp != std::string::npos) {
+      r.comment = h.substr(sp + 1);
+    }
+    bool fastq = (*p == '@');
+    p = le + 1;
+    while (p < e && *p != (fastq ? '+' : '>')) {
+      le = line_end(p);
+      append(r.seq, p, le);
+      p = le + 1;
+    }
+    if (fastq && p < e) {
+      p = line_end(p) + 1;
+      while (p < e && r.qual.size() < r.seq.size()) {
+        le = line_end(p);
+        append(r.qual, p, le);
+        p = le + 1;
+      }
+    }
+  }
+}
+
+/// \brief First record boundary at or after pos: a line starting with
+/// '>' for FASTA; for (4 line) FASTQ a line starting with '@' whose
+/// second next line starts with '+' (quality lines may start with '@'
+/// but are never followed two lines later by a '+' line).
+inline size_t
+resync_record(const char* data, size_t size, size_t pos, bool fastq) {
+  const char* e = data + size;
+  auto next_line = [e](const char* p) {
+    const char* nl = static_cast<const char*>(std::memchr(p, '\n', e - p));
+    return nl ? nl + 1 : e;
+  };
+  const char* p = data + pos;
+  if (pos > 0 && *(p - 1) != '\n') {
+    p = next_line(p);
+  }
+  for (; p < e; p = next_line(p)) {
+    if (!fastq) {
+      if (*p == '>') {
+        return p - data;
+      }
+      continue;
+    }
+    if (*p == '@') {
+      const char* l3 = next_line(next_line(p));
+      if (l3 < e && *l3 == '+') {
+        return p - data;
+      }
+    }
+  }
+  return size;
+}
+
+struct record_batch
+{
+  size_t index;
+  std::vector<sequence_record> records;
+  /// set when parsing the chunk failed, such batches are not passed to
+  /// the consumer, the exception is rethrown by parallel_parse instead
+  std::exception_ptr error;
+};
+
+/// \brief Parses the FASTA/FASTQ in [data, data + size) in parallel:
+/// the buffer is split in byte ranges of about chunk_size, each range
+/// is moved to a record boundary and parsed by a task on pool. Batches
+/// are passed to consumer (on the calling thread) in file order when
+/// ordered is true, otherwise as soon as they are ready. At most
+/// 2 * pool.size() batches are in flight. If a task or the consumer
+/// throws, the submitted tasks are waited for and the first exception
+/// is rethrown.
+template <typename _ConsumerT>
+void
+parallel_parse(const char* data, size_t size, ctl::thread_pool& pool, _ConsumerT consumer,
+               bool ordered = true, size_t chunk_size = size_t(1) << 26) {
+  size_t first = 0;
+  while (first < size && data[first] != '>' && data[first] != '@') {
+    const char* nl = static_cast<const char*>(std::memchr(data + first, '\n', size - first));
+    first = nl ? (nl - data) + 1 : size;
+  }
+  if (first == size) {
+    return;
+  }
+  const bool fastq = (data[first] == '@');
+  std::vector<size_t> bounds { first };
+  for (size_t pos = first + chunk_size; pos < size; pos += chunk_size) {
+    size_t b = resync_record(data, size, pos, fastq);
+    if (b > bounds.back() && b < size) {
+      bounds.push_back(b);
+    }
+  }
+  bounds.push_back(size);
+  const size_t n_chunks = bounds.size() - 1;
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<record_batch> ready;
+  std::vector<std::future<void>> futures;
+  size_t submitted = 0, consumed = 0, next_ordered = 0;
+  std::map<size_t, record_batch> pending;
+  const size_t window = 2 * pool.size();
+
+  auto submit = [&](size_t i) {
+    futures.push_back(pool.submit([&, i]() {
+      record_batch batch;
+      batch.index = i;
+      try {
+        parse_records(data + bounds[i], data + bounds[i + 1], batch.records);
+      } catch (...) {
+        // the batch is pushed anyway so that the waiter always wakes
+        batch.records.clear();
+        batch.error = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lk(m);
+        ready.push_back(std::move(batch));
+      }
+      cv.notify_one();
+    }));
+  };
+  try {
+    for (; submitted < n_chunks && submitted < window; ++submitted) {
+      submit(submitted);
+    }
+    while (consumed < n_chunks) {
+      record_batch batch;
+      {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [&]() { return !ready.empty(); });
+        batch = std::move(ready.front());
+        ready.pop_front();
+      }
+      if (batch.error) {
+        std::rethrow_exception(batch.error);
+      }
+      if (submitted < n_chunks) {
+        submit(submitted++);
+      }
+      if (!ordered) {
+        ++consumed;
+        consumer(std::move(batch));
+        continue;
+      }
+      pending.emplace(batch.index, std::move(batch));
+      for (auto it = pending.find(next_ordered); it != pending.end();
+           it = pending.find(next_ordered)) {
+        record_batch b = std::move(it->second);
+        pending.erase(it);
+        ++next_ordered;
+        ++consumed;
+        consumer(std::move(b));
+      }
+    }
+  } catch (...) {
+    ctl::wait_all(futures.begin(), futures.end());
+    throw;
+  }
+  ctl::get_all(futures.begin(), futures.end());
+}
+
+/// \brief parallel_parse over a memory mapped file.
+template <typename _ConsumerT>
+void
+parallel_parse_file(const std::string& path, ctl::thread_pool& pool, _ConsumerT consumer,
+                    bool ordered = true, size_t chunk_size = size_t(1) << 26) {
+  ctl::mapped_file f(path, true);
+  parallel_parse(f.data(), f.size(), pool, consumer, ordered, chunk_size);
+}
+
+/// \brief Forward iterator over the bases of a FASTA sequence block,
+/// line terminators ('\n' and '\r') are skipped.
+class fasta_sequence_iterator
+{
+public:
+  typedef std::forward_iterator_tag iterator_category;
+  typedef char value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef const char* pointer;
+  typedef const char& reference;
+
+  fasta_sequence_iterator() : _p {nullptr}, _e {nullptr} { }
+  fasta_sequence_iterator(const char* p, const char* e) : _p {p}, _e {e} { skip(); }
+
+  reference operator*() const { return *_p; }
+  fasta_sequence_iterator& operator++() { ++_p; skip(); return *this; }
+  fasta_sequence_iterator operator++(int) { auto t = *this; ++(*this); return t; }
+  bool operator==(const fasta_sequence_iterator& o) const { return _p == o._p; }
+  bool operator!=(const fasta_sequence_iterator& o) const { return _p != o._p; }
+
+private:
+  const char* _p;
+  const char* _e;
+
+  void skip() { while (_p != _e && (*_p == '\n' || *_p == '\r')) { ++_p; } }
+};
+
+/// \brief A FASTA record inside a memory mapped file: the header
+/// (without '>') and the raw sequence block (with line terminators).
+struct fasta_record_view
+{
+  std::string_view header;
+  std::string_view raw;
+  size_t length;
+
+  fasta_sequence_iterator begin() const { return fasta_sequence_iterator(raw.data(), raw.data() + raw.size()); }
+  fasta_sequence_iterator end() const { return fasta_sequence_iterator(raw.data() + raw.size(), raw.data() + raw.size()); }
+  size_t size() const { return length; }
+
+  /// \brief Appends the sequence to out copying whole lines at a time.
+  void
+  copy_to(std::string& out) const {
+    out.reserve(out.size() + length);
+    const char* p = raw.data();
+    const char* e = p + raw.size();
+    while (p < e) {
+      const char* nl = static_cast<const char*>(std::memchr(p, '\n', e - p));
+      const char* le = nl ? nl : e;
+      const char* ce = (le > p && *(le - 1) == '\r') ? le - 1 : le;
+      out.append(p, ce - p);
+      p = nl ? nl + 1 : e;
+    }
+  }
+
+  std::string
+  sequence() const {
+    std::string s;
+    copy_to(s);
+    return s;
+  }
+};
+
+/// \brief Indexes every record of a FASTA held in memory in one pass.
+inline std::vector<fasta_record_view>
+index_fasta(const char* data, size_t size) {
+  std::vector<fasta_record_view> records;
+  const char* p = data;
+  const char* e = data + size;
+  // skip anything before the first header
+  while (p < e && *p != '>') {
+    const char* nl = static_cast<const char*>(std::memchr(p, '\n', e - p));
+    p = nl ? nl + 1 : e;
+  }
+  while (p < e) {
+    const char* nl = static_cast<const char*>(std::memchr(p, '\n', e - p));
+    const char* he = nl ? nl : e;
+    fasta_record_view r;
+    r.header = std::string_view(p + 1, ((he > p + 1 && *(he - 1) == '\r') ? he - 1 : he) - (p + 1));
+    const char* s = nl ? nl + 1 : e;
+    const char* q = s;
+    size_t len = 0;
+    while (q < e && *q != '>') {
+      const char* lnl = static_cast<const char*>(std::memchr(q, '\n', e - q));
+      const char* le = lnl ? lnl : e;
+      len += (le - q) - ((le > q && *(le - 1) == '\r') ? 1 : 0);
+      q = lnl ? lnl + 1 : e;
+    }
+    r.raw = std::string_view(s, q - s);
+    r.length = len;
+    records.push_back(r);
+    p = q;
+  }
+  return records;
+}
+
+/// \brief Zero-copy reader of a (multi record) FASTA file: the file is
+/// mapped in memory and all records are indexed when opened. Views
+/// returned by the reader are valid as long as the reader is alive.
+class mapped_fasta
+{
+public:
+  mapped_fasta() { }
+  explicit mapped_fasta(const std::string& path) { open(path); }
+
+  void
+  open(const std::string& path) {
+    _file.open(path, true);
+    _records = index_fasta(_file.data(), _file.size());
+  }
+
+  size_t size() const { return _records.size(); }
+  const fasta_record_view& operator[](size_t i) const { return _records[i]; }
+  std::vector<fasta_record_view>::const_iterator begin() const { return _records.begin(); }
+  std::vector<fasta_record_view>::const_iterator end() const { return _records.end(); }
+
+  /// \brief Record whose name (header up to the first blank) is name,
+  /// nullptr if absent.
+  const fasta_record_view*
+  find(std::string_view name) const {
+    for (const auto& r : _records) {
+      std::string_view n = r.header.substr(0, r.header.find_first_of(" \t"));
+      if (n == name) {
+        return &r;
+      }
+    }
+    return nullptr;
+  }
+
+private:
+  ctl::mapped_file _file;
+  std::vector<fasta_record_view> _records;
+};
+
+// FASTA index (.fai, samtools faidx compatible): for every record its
+// name, length, byte offset of the first base, bases per line and bytes
+// per line (including the terminator).
+
+struct fai_entry
+{
+  std::string name;
+  uint64_t length;
+  uint64_t offset;
+  uint64_t line_bases;
+  uint64_t line_width;
+
+  /// \brief Byte offset of base pos in the FASTA file.
+  uint64_t
+  byte_of(uint64_t pos) const {
+    return offset + (pos / line_bases) * line_width + pos % line_bases;
+  }
+};
+
+/// \brief Builds the .fai entries of a FASTA in one streaming pass.
+/// Throws std::runtime_error if a record has lines of different length
+/// (other than the last one), as samtools does.
+template <typename _SourceT>
+std::vector<fai_entry>
+build_fai(_SourceT& src, size_t buffer_size = size_t(1) << 22) {
+  std::vector<fai_entry> entries;
+  double_buffered_reader<_SourceT> in(src, buffer_size);
+  uint64_t pos = 0;        // offset of the current line start
+  uint64_t width = 0;      // bytes of the current line seen so far
+  char first = 0;
+  char last = 0;
+  std::string header;
+  bool in_record = false;
+  bool short_line = false;
+
+  auto end_line = [&](bool terminated) {
+    uint64_t bases = width - (terminated ? 1 : 0) - (last == '\r' ? 1 : 0);
+    if (first == '>') {
+      size_t sp = header.find_first_of(" \t\r");
+      entries.push_back(fai_entry { header.substr(1, sp == std::string::npos ? sp : sp - 1),
+                                    0, pos + width, 0, 0 });
+      in_record = true;
+      short_line = false;
+    } else if (in_record && width > 0) {
+      fai_entry& e = entries.back();
+      if (e.line_bases == 0 && e.length == 0) {
+        e.line_bases = bases;
+        // an unterminated single line gets the width it would have
+        e.line_width = terminated ? width : width + 1;
+      } else if (short_line || bases > e.line_bases) {
+        throw std::runtime_error("fai: different line length in sequence " + e.name);
+      }
+      short_line = (bases < e.line_bases) || (width != e.line_width && terminated);
+      e.length += bases;
+    }
+    pos += width;
+    width = 0;
+    first = 0;
+    last = 0;
+    header.clear();
+  };
+
+  for (std::string_view c = in.next_chunk(); !c.empty(); c = in.next_chunk()) {
+    const char* p = c.data();
+    const char* e = p + c.size();
+    while (p < e) {
+      if (width == 0) {
+        first = *p;
+      }
+      const char* nl = static_cast<const char*>(std::memchr(p, '\n', e - p));
+      const char* le = nl ? nl + 1 : e;
+      if (first == '>') {
+        header.append(p, (nl ? nl : e) - p);
+      }
+      width += le - p;
+      last = nl ? (nl > p ? *(nl - 1) : last) : *(e - 1);
+      p = le;
+      if (nl) {
+        end_line(true);
+      }
+    }
+  }
+  if (width > 0) {
+    end_line(false);
+  }
+  return entries;
+}
+
+inline std::vector<fai_entry>
+build_fai(const std::string& fasta_path) {
+  istream_source src(fasta_path);
+  return build_fai(src);
+}
+
+template <typename _StreamT>
+void
+write_fai(_StreamT& os, const std::vector<fai_entry>& entries) {
+  for (const auto& e : entries) {
+    os << e.name << '\t' << e.length << '\t' << e.offset << '\t'
+       << e.line_bases << '\t' << e.line_width << '\n';
+  }
+}
+
+template <typename _StreamT>
+std::vector<fai_entry>
+read_fai(_StreamT& is) {
+  std::vector<fai_entry> entries;
+  std::string line;
+  while (std::getline(is, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    std::istringstream ls(line);
+    fai_entry e;
+    ls >> e.name >> e.length >> e.offset >> e.line_bases >> e.line_width;
+    if (!ls) {
+      throw std::runtime_error("fai: malformed line: " + line);
+    }
+    entries.push_back(e);
+  }
+  return entries;
+}
+
+/// \brief A region with 0-based, half open coordinates.
+struct fasta_region
+{
+  std::string name;
+  uint64_t start;
+  uint64_t end;
+};
+
+/// \brief Parses a samtools style region "name", "name:start" or
+/// "name:start-end" (1-based, inclusive). The name ends at the last
+/// ':', use indexed_fasta::parse_region for names containing ':'.
+/// Throws std::invalid_argument when start is past end.
+inline fasta_region
+parse_region(const std::string& s) {
+  fasta_region r { s, 0, std::numeric_limits<uint64_t>::max() };
+  size_t colon = s.rfind(':');
+  if (colon == std::string::npos) {
+    return r;
+  }
+  std::string range = s.substr(colon + 1);
+  range.erase(std::remove(range.begin(), range.end(), ','), range.end());
+  size_t dash = range.find('-');
+  try {
+    uint64_t b = std::stoull(range.substr(0, dash));
+    r.start = b > 0 ? b - 1 : 0;
+    if (dash != std::string::npos) {
+      r.end = std::stoull(range.substr(dash + 1));
+    }
+  } catch (const std::exception&) {
+    return fasta_region { s, 0, std::numeric_limits<uint64_t>::max() };
+  }
+  if (r.start >= r.end) {
+    throw std::invalid_argument("region start is past its end: " + s);
+  }
+  r.name = s.substr(0, colon);
+  return r;
+}
+
+/// \brief Random access to the regions of an indexed FASTA. Only the
+/// bytes spanning a region are read (pread), regions can be fetched in
+/// parallel since no state is shared between fetches.
+class indexed_fasta
+{
+public:
+  /// \brief Opens fasta_path using fasta_path + ".fai", the index is
+  /// built in memory if the file is missing (see write_index).
+  explicit indexed_fasta(const std::string& fasta_path)
+    : _path {fasta_path}, _fd {-1} {
+    std::ifstream fai(fasta_path + ".fai");
+    if (fai) {
+      _entries = read_fai(fai);
+    } else {
+      _entries = build_fai(fasta_path);
+    }
+    open(fasta_path);
+  }
+
+  indexed_fasta(const std::string& fasta_path, std::vector<fai_entry> entries)
+    : _entries {std::move(entries)}, _path {fasta_path}, _fd {-1}
+  {
+    open(fasta_path);
+  }
+
+  indexed_fasta(const indexed_fasta&) = delete;
+  indexed_fasta& operator=(const indexed_fasta&) = delete;
+
+  ~indexed_fasta() {
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+  }
+
+  const std::vector<fai_entry>& entries() const { return _entries; }
+
+  /// \brief Writes the index to fai_path (the FASTA path + ".fai" when
+  /// empty), throws std::runtime_error if it cannot be written.
+  void
+  write_index(std::string fai_path = "") const {
+    if (fai_path.empty()) {
+      fai_path = _path + ".fai";
+    }
+    std::ofstream out(fai_path);
+    write_fai(out, _entries);
+    out.close();
+    if (!out) {
+      throw std::runtime_error("fai: cannot write " + fai_path);
+    }
+  }
+
+  /// \brief Like btl::parse_region, but a string that is the name of a
+  /// sequence of the index is taken as a whole (as samtools does), so
+  /// names containing ':' (e.g., HLA alleles) are not split.
+  fasta_region
+  parse_region(const std::string& s) const {
+    if (_by_name.count(s) > 0) {
+      return fasta_region { s, 0, std::numeric_limits<uint64_t>::max() };
+    }
+    return btl::parse_region(s);
+  }
+
+  /// \brief Index of the sequence called name, entries().size() if absent.
+  size_t
+  find(const std::string& name) const {
+    auto it = _by_name.find(name);
+    return it == _by_name.end() ? _entries.size() : it->second;
+  }
+
+  /// \brief Bases [start, end) of sequence idx (clipped to its length).
+  void
+  fetch(size_t idx, uint64_t start, uint64_t end, std::string& out) const {
+    out.clear();
+    const fai_entry& e = _entries[idx];
+    end = std::min(end, e.length);
+    if (start >= end) {
+      return;
+    }
+    uint64_t b = e.byte_of(start);
+    uint64_t l = e.byte_of(end - 1) + 1;
+    std::string raw(l - b, '\0');
+    size_t got = 0;
+    while (got < raw.size()) {
+      ssize_t r = ::pread(_fd, &raw[got], raw.size() - got, static_cast<off_t>(b + got));
+      if (r <= 0) {
+        throw std::runtime_error("fai: read error in " + e.name);
+      }
+      got += static_cast<size_t>(r);
+    }
+    out.reserve(end - start);
+    const char* p = raw.data();
+    const char* q = p + raw.size();
+    while (p < q) {
+      const char* nl = static_cast<const char*>(std::memchr(p, '\n', q - p));
+      const char* le = nl ? nl : q;
+      out.append(p, ((le > p && *(le - 1) == '\r') ? le - 1 : le) - p);
+      p = nl ? nl + 1 : q;
+    }
+  }
+
+  std::string
+  fetch(const fasta_region& r) const {
+    std::string s;
+    size_t idx = find(r.name);
+    if (idx == _entries.size()) {
+      throw std::out_of_range("fai: unknown sequence " + r.name);
+    }
+    fetch(idx, r.start, r.end, s);
+    return s;
+  }
+
+  std::string fetch(const std::string& region) const { return fetch(parse_region(region)); }
+
+  /// \brief Fetches a batch of regions in parallel on pool.
+  std::vector<std::string>
+  fetch(const std::vector<fasta_region>& regions, ctl::thread_pool& pool) const {
+    std::vector<std::string> out(regions.size());
+    ctl::parallel_for(pool, regions.size(),
+                      [&](size_t i) { out[i] = fetch(regions[i]); }, 64);
+    return out;
+  }
+
+private:
+  std::vector<fai_entry> _entries;
+  std::map<std::string, size_t> _by_name;
+  std::string _path;
+  int _fd;
+
+  void
+  open(const std::string& path) {
+    _fd = ::open(path.c_str(), O_RDONLY);
+    if (_fd < 0) {
+      throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    for (size_t i = 0; i < _entries.size(); ++i) {
+      _by_name[_entries[i].name] = i;
+    }
+  }
+};
+
+// 2bit genome format (UCSC): header, record index, then for every record
+// its size, N-runs, soft mask runs and the bases packed 4 per byte
+// (first base in the high bits, T=0, C=1, A=2, G=3). Version 1 files
+// use 64 bit record offsets.
+
+constexpr uint32_t twobit_signature = 0x1A412743;
+
+/// \brief A record packed in memory, ready to be written as 2bit.
+struct twobit_record
+{
+  std::string name;
+  uint32_t size = 0;
+  std::vector<uint32_t> n_starts, n_sizes;
+  std::vector<uint32_t> mask_starts, mask_sizes;
+  std::vector<uint8_t> packed;
+
+  /// \brief Appends bases to the record tracking N and lower case runs.
+  void
+  append(const char* s, size_t n) {
+    static const uint8_t code[4] = { 2, 1, 3, 0 }; // A C G T -> 2bit
+    packed.resize((size + n + 3) / 4, 0);
+    for (size_t i = 0; i < n; ++i, ++size) {
+      char c = s[i];
+      uint8_t nc = ctl::nucleotide_code(c);
+      uint8_t b = 0; // anything but ACGT is stored as T, as UCSC tools do
+      if (nc == ctl::nucleotide_invalid) {
+        extend_run(n_starts, n_sizes, size);
+      } else {
+        b = code[nc];
+      }
+      if (c >= 'a' && c <= 'z') {
+        extend_run(mask_starts, mask_sizes, size);
+      }
+      packed[size / 4] |= static_cast<uint8_t>(b << (6 - 2 * (size % 4)));
+    }
+  }
+
+private:
+  static void
+  extend_run(std::vector<uint32_t>& st, std::vector<uint32_t>& sz, uint32_t pos) {
+    if (!st.empty() && st.back() + sz.back() == pos) {
+      sz.back()++;
+    } else {
+      st.push_back(pos);
+      sz.push_back(1);
+    }
+  }
+};
+
+inline void
+twobit_put32(std::string& out, uint32_t v) {
+  char b[4];
+  std::memcpy(b, &v, 4);
+  out.append(b, 4);
+}
+
+inline void
+twobit_put_array(std::string& out, const std::vector<uint32_t>& v) {
+  if (!v.empty()) {
+    out.append(reinterpret_cast<const char*>(v.data()), v.size() * 4);
+  }
+}
+
+/// \brief Writes records as a 2bit file (native byte order, as UCSC).
+template <typename _StreamT>
+void
+write_twobit(_StreamT& os, const std::vector<twobit_record>& records) {
+  uint64_t index_size = 0;
+  for (const auto& r : records) {
+    index_size += 1 + r.name.size() + 4;
+  }
+  std::vector<uint64_t> rec_sizes;
+  uint64_t total = 16 + index_size;
+  for (const auto& r : records) {
+    uint64_t sz = 4 + 4 + 8 * r.n_starts.size() + 4 + 8 * r.mask_starts.size() + 4 + r.packed.size();
+    rec_sizes.push_back(sz);
+    total += sz;
+  }
+  const bool v1 = total > 0xffffffffull;
+  if (v1) {
+    index_size += 4 * records.size();
+  }
+  for (const auto& r : records) {
+    if (r.name.size() > 255) {
+      throw std::invalid_argument("twobit: record name longer than 255 characters: "
+                                  + r.name.substr(0, 32) + "...");
+    }
+  }
+  std::string out;
+  twobit_put32(out, twobit_signature);
+  twobit_put32(out, v1 ? 1 : 0);
+  twobit_put32(out, static_cast<uint32_t>(records.size()));
+  twobit_put32(out, 0);
+  uint64_t offset = 16 + index_size;
+  for (size_t i = 0; i < records.size(); ++i) {
+    out.push_back(static_cast<char>(records[i].name.size()));
+    out += records[i].name;
+    if (v1) {
+      char b[8];
+      std::memcpy(b, &offset, 8);
+      out.append(b, 8);
+    } else {
+      twobit_put32(out, static_cast<uint32_t>(offset));
+    }
+    offset += rec_sizes[i];
+  }
+  os.write(out.data(), out.size());
+  for (const auto& r : records) {
+    out.clear();
+    twobit_put32(out, r.size);
+    twobit_put32(out, static_cast<uint32_t>(r.n_starts.size()));
+    twobit_put_array(out, r.n_starts);
+    twobit_put_array(out, r.n_sizes);
+    twobit_put32(out, static_cast<uint32_t>(r.mask_starts.size()));
+    twobit_put_array(out, r.mask_starts);
+    twobit_put_array(out, r.mask_sizes);
+    twobit_put32(out, 0);
+    os.write(out.data(), out.size());
+    os.write(reinterpret_cast<const char*>(r.packed.data()), r.packed.size());
+  }
+}
+
+/// \brief Converts a FASTA stream to 2bit. The text is read record by
+/// record; records are kept packed (1/4 of the text size) until the
+/// index can be written.
+template <typename _OStreamT>
+void
+fasta_to_twobit(std::istream& is, _OStreamT& os) {
+  istream_source src(is);
+  record_reader<istream_source> reader(src);
+  std::vector<twobit_record> records;
+  sequence_record r;
+  while (reader.next(r)) {
+    records.emplace_back();
+    records.back().name = r.name;
+    records.back().append(r.seq.data(), r.seq.size());
+  }
+  write_twobit(os, records);
+}
+
+/// \brief Memory mapped 2bit file with random access extraction of
+/// any region of any record. The N and mask run tables are copied out
+/// of the mapping (they are not 4 byte aligned in the file), the packed
+/// bases are read in place.
+class twobit_file
+{
+public:
+  struct record_info
+  {
+    std::string name;
+    uint32_t size;
+    std::vector<uint32_t> n_starts;
+    std::vector<uint32_t> n_sizes;
+    std::vector<uint32_t> mask_starts;
+    std::vector<uint32_t> mask_sizes;
+    const uint8_t* packed;
+  };
+
+  twobit_file() { }
+  explicit twobit_file(const std::string& path) { open(path); }
+
+  void
+  open(const std::string& path) {
+    _file.open(path);
+    _records.clear();
+    _by_name.clear();
+    const char* d = _file.data();
+    const uint64_t fsize = _file.size();
+    if (fsize < 16 || get32(d) != twobit_signature) {
+      throw std::runtime_error("twobit: bad signature (or foreign byte order) in " + path);
+    }
+    auto need = [&](uint64_t p, uint64_t n) {
+      if (p > fsize || n > fsize - p) {
+        throw std::runtime_error("twobit: truncated or corrupt file " + path);
+      }
+    };
+    uint32_t version = get32(d + 4);
+    uint32_t count = get32(d + 8);
+    uint64_t p = 16;
+    for (uint32_t i = 0; i < count; ++i) {
+      record_info r;
+      need(p, 1);
+      uint8_t len = static_cast<uint8_t>(d[p]);
+      need(p + 1, len);
+      r.name.assign(d + p + 1, len);
+      p += 1 + len;
+      uint64_t off;
+      if (version == 1) {
+        need(p, 8);
+        std::memcpy(&off, d + p, 8);
+        p += 8;
+      } else {
+        need(p, 4);
+        off = get32(d + p);
+        p += 4;
+      }
+      need(off, 8);
+      r.size = get32(d + off);
+      uint64_t q = off + 4;
+      read_runs(d, q, need, r.n_starts, r.n_sizes);
+      read_runs(d, q, need, r.mask_starts, r.mask_sizes);
+      // reserved word, then the packed bases
+      need(q, 4 + (uint64_t(r.size) + 3) / 4);
+      r.packed = reinterpret_cast<const uint8_t*>(d + q + 4);
+      _records.push_back(std::move(r));
+      _by_name[_records.back().name] = i;
+    }
+  }
+
+  size_t size() const { return _records.size(); }
+  const record_info& record(size_t i) const { return _records[i]; }
+
+  /// \brief Index of the record called name, size() if absent.
+  size_t
+  find(const std::string& name) const {
+    auto it = _by_name.find(name);
+    return it == _by_name.end() ? _records.size() : it->second;
+  }
+
+  /// \brief Writes bases [start, end) of record rec to out (resized),
+  /// N-runs are restored and soft masked runs are lower case when
+  /// soft_mask is true.
+  void
+  region(size_t rec, uint32_t start, uint32_t end, std::string& out,
+         bool soft_mask = true) const {
+    static const char bases[4] = { 'T', 'C', 'A', 'G' };
+    const record_info& r = _records[rec];
+    end = std::min(end, r.size);
+    start = std::min(start, end);
+    out.resize(end - start);
+    uint32_t i = start;
+    char* o = out.empty() ? nullptr : &out[0];
+    // unaligned head, whole bytes, tail
+    for (; i < end && (i % 4) != 0; ++i) {
+      *o++ = bases[(r.packed[i / 4] >> (6 - 2 * (i % 4))) & 3];
+    }
+    for (; i + 4 <= end; i += 4) {
+      uint8_t b = r.packed[i / 4];
+      o[0] = bases[b >> 6];
+      o[1] = bases[(b >> 4) & 3];
+      o[2] = bases[(b >> 2) & 3];
+      o[3] = bases[b & 3];
+      o += 4;
+    }
+    for (; i < end; ++i) {
+      *o++ = bases[(r.packed[i / 4] >> (6 - 2 * (i % 4))) & 3];
+    }
+    apply_runs(r.n_starts, r.n_sizes, start, end, out,
+               [](char& c) { c = 'N'; });
+    if (soft_mask) {
+      apply_runs(r.mask_starts, r.mask_sizes, start, end, out,
+                 [](char& c) { c = static_cast<char>(c | 0x20); });
+    }
+  }
+
+  std::string
+  region(size_t rec, uint32_t start, uint32_t end, bool soft_mask = true) const {
+    std::string s;
+    region(rec, start, end, s, soft_mask);
+    return s;
+  }
+
+  /// \brief Writes the whole file as FASTA, decoding one chunk of a
+  /// record at a time.
+  template <typename _StreamT>
+  void
+  to_fasta(_StreamT& os, size_t max_line = 60) const {
+    std::string buf;
+    for (size_t i = 0; i < _records.size(); ++i) {
+      os << '>' << _records[i].name << '\n';
+      const uint64_t chunk = uint64_t(max_line ? max_line : 60) * 16384;
+      for (uint64_t s = 0; s < _records[i].size; s += chunk) {
+        region(i, static_cast<uint32_t>(s),
+               static_cast<uint32_t>(std::min<uint64_t>(s + chunk, _records[i].size)), buf);
+        std::string lines;
+        append_wrapped(lines, buf.cbegin(), buf.cend(), max_line);
+        os.write(lines.data(), lines.size());
+      }
+    }
+  }
+
+private:
+  ctl::mapped_file _file;
+  std::vector<record_info> _records;
+  std::map<std::string, size_t> _by_name;
+
+  static uint32_t
+  get32(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+  }
+
+  // count, starts and sizes of a run table at q (advanced past it)
+  template <typename _NeedT>
+  static void
+  read_runs(const char* d, uint64_t& q, _NeedT& need,
+            std::vector<uint32_t>& st, std::vector<uint32_t>& sz) {
+    need(q, 4);
+    uint64_t count = get32(d + q);
+    need(q + 4, 8 * count);
+    st.resize(count);
+    sz.resize(count);
+    if (count > 0) {
+      std::memcpy(st.data(), d + q + 4, 4 * count);
+      std::memcpy(sz.data(), d + q + 4 + 4 * count, 4 * count);
+    }
+    q += 4 + 8 * count;
+  }
+
+  template <typename _FunT>
+  static void
+  apply_runs(const std::vector<uint32_t>& st, const std::vector<uint32_t>& sz,
+             uint32_t start, uint32_t end, std::string& out, _FunT f) {
+    const size_t count = st.size();
+    // first run that may overlap [start, end)
+    auto it = std::upper_bound(st.begin(), st.end(), start);
+    size_t k = (it == st.begin()) ? 0 : static_cast<size_t>(it - st.begin()) - 1;
+    for (; k < count && st[k] < end; ++k) {
+      uint32_t b = std::max(st[k], start);
+      uint32_t e = static_cast<uint32_t>(std::min<uint64_t>(uint64_t(st[k]) + sz[k], end));
+      for (uint32_t j = b; j < e; ++j) {
+        f(out[j - start]);
+      }
+    }
+  }
+};
+
 BTL_DEFAULT_NAMESPACE_END
 
 #endif
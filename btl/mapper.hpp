@@ -0,0 +1,456 @@
+// btl/mapper.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file mapper.hpp \brief Seed-and-extend read mapping.
+///
+/// The reference is indexed by its (w, k)-minimizers in a CSR layout
+/// (sorted keys, offsets, positions). A read (and its reverse
+/// complement) is seeded with its own minimizers, hits are grouped by
+/// diagonal (reference position minus read position) and the best
+/// supported diagonals are verified with the banded edit distance of
+/// str/distance.hpp against the reference window starting on the
+/// diagonal. Reads are mapped in batches on a thread pool, each worker
+/// reuses its own banded engine, and results are handed to a sink in
+/// input order.
+
+#include "../btl.h"
+
+#include "../str/distance.hpp"
+#include "../str/kmer.hpp"
+#include "../str/nucleotide.hpp"
+#include "../thread/thread_pool.hpp"
+#include "io.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _BTL_MAPPER_
+#define _BTL_MAPPER_
+
+BTL_DEFAULT_NAMESPACE_BEGIN
+
+/// \brief Invertible 64 bit mix used to order k-mers, so that
+/// minimizers are not biased towards poly-A.
+inline uint64_t
+kmer_hash(uint64_t key, uint64_t mask) {
+  key = (~key + (key << 21)) & mask;
+  key = key ^ (key >> 24);
+  key = ((key + (key << 3)) + (key << 8)) & mask;
+  key = key ^ (key >> 14);
+  key = ((key + (key << 2)) + (key << 4)) & mask;
+  key = key ^ (key >> 28);
+  key = (key + (key << 31)) & mask;
+  return key;
+}
+
+/// \brief Calls f(hash, pos) for every (w, k)-minimizer of [b, e): the
+/// k-mer with the smallest hash among w consecutive ACGT k-mers (the
+/// rightmost on ties). Each minimizer is reported once.
+template <typename _IterT, typename _FunT>
+void
+for_each_minimizer(_IterT b, _IterT e, size_t k, size_t w, _FunT f) {
+  const uint64_t mask = (k >= 32) ? ~uint64_t(0) : ((uint64_t(1) << (2 * k)) - 1);
+  // monotone queue of (hash, pos) with increasing hashes
+  std::deque<std::pair<uint64_t, size_t>> q;
+  size_t count = 0;
+  size_t last = std::numeric_limits<size_t>::max();
+  size_t prev_pos = std::numeric_limits<size_t>::max();
+  ctl::for_each_kmer_code(b, e, k, [&](uint64_t code, size_t pos) {
+    // a gap of non ACGT characters restarts the windows
+    if (prev_pos != std::numeric_limits<size_t>::max() && pos != prev_pos + 1) {
+      q.clear();
+      count = 0;
+    }
+    prev_pos = pos;
+    uint64_t h = kmer_hash(code, mask);
+    while (!q.empty() && q.back().first >= h) {
+      q.pop_back();
+    }
+    q.emplace_back(h, pos);
+    ++count;
+    while (q.front().second + w <= pos) {
+      q.pop_front();
+    }
+    if (count >= w && q.front().second != last) {
+      last = q.front().second;
+      f(q.front().first, last);
+    }
+  });
+}
+
+/// \brief Minimizer index of a reference in CSR layout: for the i-th
+/// distinct hash keys[i] its positions are
+/// positions[offsets[i] .. offsets[i+1]). Positions are 32 bits wide,
+/// references of 2^32 bases or more are rejected.
+class minimizer_index
+{
+public:
+  minimizer_index(const std::string& ref, size_t k = 15, size_t w = 10,
+                  size_t n_threads = 0)
+    : _k {k}, _w {w}, _n {ref.size()} {
+    if (k < 1 || k > 32 || w < 1) {
+      throw std::invalid_argument("minimizer_index: k must be in [1, 32] and w positive");
+    }
+    if (_n > std::numeric_limits<uint32_t>::max()) {
+      throw std::length_error("minimizer_index: reference longer than 2^32 - 1 bases");
+    }
+    // chunk c owns the windows starting in it, the text is extended by
+    // the span of a window (minimizers found twice are merged below)
+    const size_t span = k + w - 1;
+    const size_t chunk = size_t(1) << 20;
+    const size_t n_chunks = (_n + chunk - 1) / chunk;
+    std::vector<std::vector<std::pair<uint64_t, uint32_t>>> parts(n_chunks);
+    ctl::thread_pool pool(n_threads);
+    ctl::parallel_for(pool, n_chunks, [&](size_t c) {
+      size_t lo = c * chunk;
+      size_t hi = std::min(_n, lo + chunk + span - 1);
+      auto& out = parts[c];
+      for_each_minimizer(ref.begin() + lo, ref.begin() + hi, k, w, [&](uint64_t h, size_t p) {
+        out.emplace_back(h, static_cast<uint32_t>(lo + p));
+      });
+    });
+    size_t total = 0;
+    for (auto& p : parts) {
+      total += p.size();
+    }
+    std::vector<std::pair<uint64_t, uint32_t>> all;
+    all.reserve(total);
+    for (auto& p : parts) {
+      all.insert(all.end(), p.begin(), p.end());
+      std::vector<std::pair<uint64_t, uint32_t>>().swap(p);
+    }
+    std::sort(all.begin(), all.end());
+    all.erase(std::unique(all.begin(), all.end()), all.end());
+    _positions.resize(all.size());
+    for (size_t i = 0; i < all.size(); ++i) {
+      if (i == 0 || all[i].first != all[i - 1].first) {
+        _keys.push_back(all[i].first);
+        _offsets.push_back(static_cast<uint32_t>(i));
+      }
+      _positions[i] = all[i].second;
+    }
+    _offsets.push_back(static_cast<uint32_t>(all.size()));
+  }
+
+  size_t k() const { return _k; }
+  size_t w() const { return _w; }
+  size_t reference_size() const { return _n; }
+  size_t distinct() const { return _keys.size(); }
+
+  /// \brief Positions of the k-mers with the given hash
+  std::pair<const uint32_t*, const uint32_t*>
+  lookup(uint64_t h) const {
+    auto it = std::lower_bound(_keys.begin(), _keys.end(), h);
+    if (it == _keys.end() || *it != h) {
+      return {nullptr, nullptr};
+    }
+    size_t i = it - _keys.begin();
+    return {_positions.data() + _offsets[i], _positions.data() + _offsets[i + 1]};
+  }
+
+private:
+  size_t _k;
+  size_t _w;
+  size_t _n;
+  std::vector<uint64_t> _keys;
+  std::vector<uint32_t> _offsets;
+  std::vector<uint32_t> _positions;
+};
+
+struct mapper_options
+{
+  size_t k = 15;
+  size_t w = 10;
+  /// minimizers with more reference occurrences are ignored
+  size_t max_occurrences = 500;
+  /// hits whose diagonals differ by at most this are chained
+  size_t diagonal_slack = 8;
+  /// minimum number of chained hits of a candidate
+  size_t min_hits = 2;
+  /// candidates verified per read
+  size_t max_candidates = 4;
+  size_t bandwidth = 8;
+  bool both_strands = true;
+  size_t batch_size = 1024;
+  size_t n_threads = 0;
+};
+
+/// \brief Outcome for one read, \c position is the reference start of
+/// the verified window and \c reverse tells whether the reverse
+/// complement of the read was mapped.
+struct mapping_result
+{
+  bool mapped = false;
+  bool reverse = false;
+  uint64_t position = 0;
+  size_t distance = 0;
+  size_t hits = 0;
+};
+
+class read_mapper
+{
+public:
+  typedef ctl::EditDistanceBandApproxLinSpace<size_t> engine_type;
+
+  /// \brief The reference is not copied and must outlive the mapper.
+  read_mapper(const std::string& ref, const mapper_options& opt = mapper_options())
+    : _ref {ref}, _opt {opt}, _index(ref, opt.k, opt.w, opt.n_threads) { }
+
+  read_mapper(const std::string&& ref, const mapper_options& opt = mapper_options()) = delete;
+
+  const minimizer_index& index() const { return _index; }
+  const mapper_options& options() const { return _opt; }
+
+  /// \brief Maps one sequence (with its own scratch space)
+  mapping_result
+  map(const std::string& seq) const {
+    worker wk;
+    return map(seq, wk);
+  }
+
+  /// \brief Maps every record produced by src.next(rec) (e.g., a
+  /// record_reader) and calls sink(rec, result) in input order.
+  /// Returns the number of records. If src or sink throws, the queued
+  /// batches are completed before the exception is rethrown.
+  template <typename _SourceT, typename _SinkT>
+  size_t
+  map_all(_SourceT& src, _SinkT sink) const {
+    typedef std::vector<sequence_record> batch_type;
+    typedef std::pair<std::unique_ptr<batch_type>, std::future<std::vector<mapping_result>>> job_type;
+    // the state shared with the tasks is declared before the pool, so
+    // that it outlives the pool even if the waits below are skipped
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<worker*> idle;
+    std::mutex m;
+    std::deque<job_type> jobs;
+    ctl::thread_pool pool(_opt.n_threads);
+    const size_t in_flight = 2 * pool.size();
+    size_t n = 0;
+
+    auto drain = [&]() {
+      job_type& j = jobs.front();
+      std::vector<mapping_result> res = j.second.get();
+      for (size_t i = 0; i < res.size(); ++i) {
+        sink(static_cast<const sequence_record&>((*j.first)[i]), static_cast<const mapping_result&>(res[i]));
+      }
+      jobs.pop_front();
+    };
+
+    try {
+      bool more = true;
+      while (more) {
+        auto batch = std::make_unique<batch_type>(std::max<size_t>(1, _opt.batch_size));
+        size_t filled = 0;
+        while (filled < batch->size() && (more = src.next((*batch)[filled]))) {
+          ++filled;
+        }
+        batch->resize(filled);
+        if (filled == 0) {
+          break;
+        }
+        n += filled;
+        const batch_type* bp = batch.get();
+        auto f = pool.submit([this, bp, &m, &workers, &idle]() {
+          worker* wk;
+          {
+            std::lock_guard<std::mutex> lk(m);
+            if (idle.empty()) {
+              workers.push_back(std::make_unique<worker>());
+              idle.push_back(workers.back().get());
+            }
+            wk = idle.back();
+            idle.pop_back();
+          }
+          std::vector<mapping_result> out(bp->size());
+          for (size_t i = 0; i < bp->size(); ++i) {
+            out[i] = map((*bp)[i].seq, *wk);
+          }
+          std::lock_guard<std::mutex> lk(m);
+          idle.push_back(wk);
+          return out;
+        });
+        jobs.emplace_back(std::move(batch), std::move(f));
+        if (jobs.size() >= in_flight) {
+          drain();
+        }
+      }
+      while (!jobs.empty()) {
+        drain();
+      }
+    } catch (...) {
+      for (auto& j : jobs) {
+        if (j.second.valid()) {
+          j.second.wait();
+        }
+      }
+      throw;
+    }
+    return n;
+  }
+
+private:
+  // per thread scratch: banded engine (grown on demand) and buffers
+  struct worker
+  {
+    std::unique_ptr<engine_type> engine;
+    size_t capacity = 0;
+    size_t band = 0;
+    std::string rc;
+    std::vector<std::pair<int64_t, bool>> diagonals;
+    std::vector<std::pair<size_t, std::pair<int64_t, bool>>> candidates;
+  };
+
+  const std::string& _ref;
+  mapper_options _opt;
+  minimizer_index _index;
+
+  engine_type&
+  engine(worker& wk, size_t len, size_t band) const {
+    if (!wk.engine || wk.capacity < len || wk.band != band) {
+      wk.capacity = std::max(len, wk.capacity);
+      wk.band = band;
+      wk.engine = std::make_unique<engine_type>(wk.capacity, wk.capacity, band,
+                                                engine_type::CostVector {1, 1, 1});
+    }
+    return *wk.engine;
+  }
+
+  void
+  seed(const std::string& s, bool reverse, worker& wk) const {
+    for_each_minimizer(s.begin(), s.end(), _index.k(), _index.w(), [&](uint64_t h, size_t q) {
+      auto r = _index.lookup(h);
+      if (static_cast<size_t>(r.second - r.first) > _opt.max_occurrences) {
+        return;
+      }
+      for (const uint32_t* p = r.first; p != r.second; ++p) {
+        wk.diagonals.emplace_back(static_cast<int64_t>(*p) - static_cast<int64_t>(q), reverse);
+      }
+    });
+  }
+
+  mapping_result
+  map(const std::string& seq, worker& wk) const {
+    mapping_result best;
+    const size_t L = seq.size();
+    if (L < _index.k() || L > _ref.size()) {
+      return best;
+    }
+    wk.diagonals.clear();
+    seed(seq, false, wk);
+    if (_opt.both_strands) {
+      wk.rc.assign(seq.rbegin(), seq.rend());
+      for (auto& c : wk.rc) {
+        uint8_t code = ctl::nucleotide_code(c);
+        c = (code == ctl::nucleotide_invalid) ? 'N' : ctl::nucleotide_char(ctl::complement_code(code));
+      }
+      seed(wk.rc, true, wk);
+    }
+    // chain hits on close diagonals of the same strand
+    std::sort(wk.diagonals.begin(), wk.diagonals.end(),
+              [](const std::pair<int64_t, bool>& a, const std::pair<int64_t, bool>& b) {
+                return a.second != b.second ? a.second < b.second : a.first < b.first;
+              });
+    wk.candidates.clear();
+    const int64_t slack = static_cast<int64_t>(_opt.diagonal_slack);
+    for (size_t i = 0; i < wk.diagonals.size();) {
+      size_t j = i;
+      while (j < wk.diagonals.size() && wk.diagonals[j].second == wk.diagonals[i].second
+             && wk.diagonals[j].first - wk.diagonals[i].first <= slack) {
+        ++j;
+      }
+      if (j - i >= _opt.min_hits) {
+        // the median diagonal of the chain
+        wk.candidates.emplace_back(j - i, wk.diagonals[i + (j - i) / 2]);
+      }
+      i = j;
+    }
+    size_t keep = std::min(_opt.max_candidates, wk.candidates.size());
+    std::partial_sort(wk.candidates.begin(), wk.candidates.begin() + keep, wk.candidates.end(),
+                      [](const auto& a, const auto& b) { return a.first > b.first; });
+
+    // verify against the reference window on the diagonal
+    const size_t band = std::min(_opt.bandwidth, L);
+    engine_type& eng = engine(wk, L, band);
+    for (size_t c = 0; c < keep; ++c) {
+      int64_t d = wk.candidates[c].second.first;
+      bool rev = wk.candidates[c].second.second;
+      int64_t start = std::max<int64_t>(0, std::min<int64_t>(d, _ref.size() - L));
+      const std::string& q = rev ? wk.rc : seq;
+      size_t dist = eng(q.begin(), q.end(), _ref.begin() + start, _ref.begin() + start + L);
+      if (!best.mapped || dist < best.distance
+          || (dist == best.distance && wk.candidates[c].first > best.hits)) {
+        best.mapped = true;
+        best.reverse = rev;
+        best.position = static_cast<uint64_t>(start);
+        best.distance = dist;
+        best.hits = wk.candidates[c].first;
+      }
+    }
+    return best;
+  }
+};
+
+/// \brief Sink writing one tab separated line per read: name, length,
+/// strand (+, - or * when unmapped), position, distance and hits.
+template <typename _StreamT>
+class mapping_writer
+{
+public:
+  explicit mapping_writer(_StreamT& os) : _os {os} { }
+
+  void
+  operator()(const sequence_record& r, const mapping_result& m) {
+    _buf.clear();
+    _buf += r.name;
+    _buf += '\t';
+    _buf += std::to_string(r.seq.size());
+    if (m.mapped) {
+      _buf += m.reverse ? "\t-\t" : "\t+\t";
+      _buf += std::to_string(m.position);
+      _buf += '\t';
+      _buf += std::to_string(m.distance);
+      _buf += '\t';
+      _buf += std::to_string(m.hits);
+    } else {
+      _buf += "\t*\t0\t0\t0";
+    }
+    _buf += '\n';
+    _os.write(_buf.data(), _buf.size());
+  }
+
+private:
+  _StreamT& _os;
+  std::string _buf;
+};
+
+template <typename _StreamT>
+mapping_writer<_StreamT>
+make_mapping_writer(_StreamT& os) {
+  return mapping_writer<_StreamT>(os);
+}
+
+BTL_DEFAULT_NAMESPACE_END
+
+#endif
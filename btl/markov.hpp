@@ -0,0 +1,235 @@
+// btl/markov.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file markov.hpp \brief Order-k Markov background model over ACGT,
+/// trained from integer k-mer codes and sampled through one alias table
+/// per context.
+
+#include "../btl.h"
+
+#include "../rand/random_sequence.hpp"
+#include "../str/kmer.hpp"
+#include "../str/nucleotide.hpp"
+
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _BTL_MARKOV_
+#define _BTL_MARKOV_
+
+BTL_DEFAULT_NAMESPACE_BEGIN
+
+class markov_model
+{
+public:
+  /// \brief Largest supported order, the tables of an order k model take
+  /// 13 * 4^(k+1) bytes (about 870 MiB for k = 12).
+  static constexpr size_t max_order = 12;
+
+  /// \brief Creates an empty model of the given order, pseudocount is
+  /// added to every transition count when the tables are built.
+  explicit markov_model(size_t order = 0, double pseudocount = 0.0)
+    : _k {checked_order(order)}, _pseudo {pseudocount},
+      _counts(size_t(1) << (2 * (order + 1)), 0), _built {false}
+  { }
+
+  size_t order() const { return _k; }
+  size_t contexts() const { return size_t(1) << (2 * _k); }
+
+  /// \brief Transition counts indexed by the (k+1)-mer code, i.e.
+  /// context * 4 + next base.
+  const std::vector<uint64_t>& counts() const { return _counts; }
+
+  /// \brief Adds the (k+1)-mers of seq to the model in one pass. Can be
+  /// called on several sequences; k-mers spanning non ACGT characters
+  /// are skipped.
+  template <typename _SeqT>
+  void
+  train(const _SeqT& seq) {
+    train(seq.begin(), seq.end());
+  }
+
+  template <typename _IterT>
+  void
+  train(_IterT b, _IterT e) {
+    uint64_t* c = _counts.data();
+    ctl::for_each_kmer_code(b, e, _k + 1, [c](uint64_t code, size_t) { c[code]++; });
+    _built = false;
+  }
+
+  /// \brief Builds the per context alias tables, called lazily by the
+  /// sampling functions.
+  void
+  build() {
+    const size_t ctx = contexts();
+    _thr.assign(ctx * 4, 0);
+    _alias.assign(ctx * 4, 0);
+    std::vector<double> marginal(ctx, 0.0);
+    double p[4];
+    size_t work[4];
+    for (size_t c = 0; c < ctx; ++c) {
+      double total = 0;
+      for (size_t b = 0; b < 4; ++b) {
+        p[b] = static_cast<double>(_counts[c * 4 + b]) + _pseudo;
+        total += p[b];
+      }
+      marginal[c] = total;
+      for (size_t b = 0; b < 4; ++b) {
+        p[b] = (total > 0) ? 4.0 * p[b] / total : 1.0;
+      }
+      ctl::build_alias_columns(p, 4, coin_full, &_thr[c * 4], &_alias[c * 4], work);
+    }
+    if (_k > 0) {
+      _start = ctl::alias_table<uint32_t>(marginal.begin(), marginal.end());
+    }
+    _built = true;
+  }
+
+  /// \brief Samples n bases into out.
+  template <typename _RandDev>
+  void
+  generate(char* out, size_t n, _RandDev& rdev) {
+    if (!_built) {
+      build();
+    }
+    const uint64_t mask = contexts() - 1;
+    uint64_t ctx = 0;
+    size_t i = 0;
+    if (_k > 0 && n > 0) {
+      ctx = _start(rdev);
+      for (; i < _k && i < n; ++i) {
+        out[i] = ctl::nucleotide_char(static_cast<uint8_t>(ctx >> (2 * (_k - 1 - i))));
+      }
+    }
+    const uint32_t* thr = _thr.data();
+    const uint8_t* al = _alias.data();
+    uint64_t word = 0;
+    unsigned left = 0;
+    for (; i < n; ++i) {
+      if (left == 0) {
+        word = ctl::random_word64(rdev);
+        left = 2;
+      }
+      uint32_t lane = static_cast<uint32_t>(word);
+      word >>= 32;
+      --left;
+      uint32_t col = lane & 3;
+      uint32_t coin = lane >> 2;
+      size_t cell = ctx * 4 + col;
+      uint8_t base = (coin < thr[cell]) ? static_cast<uint8_t>(col) : al[cell];
+      out[i] = ctl::nucleotide_char(base);
+      ctx = ((ctx << 2) | base) & mask;
+    }
+  }
+
+  template <typename _RandDev>
+  std::string
+  sample(size_t n, _RandDev& rdev) {
+    std::string s(n, 'A');
+    if (n > 0) {
+      generate(&s[0], n, rdev);
+    }
+    return s;
+  }
+
+  /// \brief Writes the model as a one line text header followed by the
+  /// transition counts as little endian 64 bit integers.
+  template <typename _StreamT>
+  void
+  save(_StreamT& os) const {
+    // enough digits for the pseudocount to round-trip exactly
+    auto prec = os.precision(std::numeric_limits<double>::max_digits10);
+    os << "ctl-markov-model 1 " << _k << " " << _pseudo << "\n";
+    os.precision(prec);
+    std::vector<unsigned char> buf(_counts.size() * 8);
+    for (size_t i = 0; i < _counts.size(); ++i) {
+      for (size_t b = 0; b < 8; ++b) {
+        buf[i * 8 + b] = static_cast<unsigned char>(_counts[i] >> (8 * b));
+      }
+    }
+    os.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+  }
+
+  template <typename _StreamT>
+  static markov_model
+  load(_StreamT& is) {
+    std::string line;
+    std::getline(is, line);
+    std::istringstream hs(line);
+    std::string magic;
+    int version = 0;
+    size_t k = 0;
+    double pseudo = 0;
+    hs >> magic >> version >> k >> pseudo;
+    if (!hs || magic != "ctl-markov-model" || version != 1) {
+      throw std::runtime_error("markov_model: invalid header");
+    }
+    markov_model m(k, pseudo);
+    std::vector<unsigned char> buf(m._counts.size() * 8);
+    is.read(reinterpret_cast<char*>(buf.data()), buf.size());
+    if (static_cast<size_t>(is.gcount()) != buf.size()) {
+      throw std::runtime_error("markov_model: truncated counts");
+    }
+    for (size_t i = 0; i < m._counts.size(); ++i) {
+      uint64_t v = 0;
+      for (size_t b = 0; b < 8; ++b) {
+        v |= static_cast<uint64_t>(buf[i * 8 + b]) << (8 * b);
+      }
+      m._counts[i] = v;
+    }
+    return m;
+  }
+
+private:
+  static constexpr uint64_t coin_full = uint64_t(1) << 30;
+
+  // validates the order before the count table is sized from it
+  static size_t
+  checked_order(size_t order) {
+    if (order > max_order) {
+      throw std::invalid_argument("markov_model: order must be at most "
+                                  + std::to_string(max_order));
+    }
+    return order;
+  }
+
+  size_t _k;
+  double _pseudo;
+  std::vector<uint64_t> _counts;
+  std::vector<uint32_t> _thr;
+  std::vector<uint8_t> _alias;
+  ctl::alias_table<uint32_t> _start;
+  bool _built;
+};
+
+template <typename _SeqT>
+markov_model
+make_markov_model(const _SeqT& seq, size_t order, double pseudocount = 0.0) {
+  markov_model m(order, pseudocount);
+  m.train(seq);
+  m.build();
+  return m;
+}
+
+BTL_DEFAULT_NAMESPACE_END
+
+#endif
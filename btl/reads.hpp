@@ -0,0 +1,333 @@
+// btl/reads.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file reads.hpp \brief Lazy read simulation from a genome with a
+/// substitution/insertion/deletion error model. Every read i is drawn
+/// from its own philox4x32 stream, therefore reads are reproducible
+/// individually and can be produced in any order or in parallel.
+
+#include "../btl.h"
+
+#include "../rand/philox.hpp"
+#include "../str/nucleotide.hpp"
+#include "../thread/thread_pool.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _BTL_READS_
+#define _BTL_READS_
+
+BTL_DEFAULT_NAMESPACE_BEGIN
+
+/// \brief Per base error probabilities. At each reference position a
+/// deletion, an insertion (before the base) or a substitution happens
+/// with the given probabilities.
+struct error_model
+{
+  double sub;
+  double ins;
+  double del;
+};
+
+inline error_model
+make_error_model(double sub, double ins = 0.0, double del = 0.0) {
+  return error_model { sub, ins, del };
+}
+
+enum class edit_type : uint8_t { substitution, insertion, deletion };
+
+/// \brief Single edit, pos is relative to the start of the reference
+/// window of the read.
+struct read_edit
+{
+  uint32_t pos;
+  edit_type type;
+  char base;
+};
+
+/// \brief A simulated read kept as a reference window plus an edit
+/// script, no sequence is stored until materialize() is called.
+struct simulated_read
+{
+  size_t id;
+  size_t pos;
+  size_t ref_length;
+  bool reverse;
+  std::vector<read_edit> edits;
+
+  template <typename _GenomeT>
+  void
+  materialize(const _GenomeT& genome, std::string& out) const {
+    out.clear();
+    auto e = edits.begin();
+    for (size_t i = 0; i < ref_length; ++i) {
+      bool deleted = false;
+      char c = genome[pos + i];
+      for (; e != edits.end() && e->pos == i; ++e) {
+        switch (e->type) {
+        case edit_type::insertion:    out.push_back(e->base); break;
+        case edit_type::substitution: c = e->base; break;
+        case edit_type::deletion:     deleted = true; break;
+        }
+      }
+      if (!deleted) {
+        out.push_back(c);
+      }
+    }
+    if (reverse) {
+      std::reverse(out.begin(), out.end());
+      for (auto& c : out) {
+        uint8_t code = ctl::nucleotide_code(c);
+        if (code != ctl::nucleotide_invalid) {
+          c = ctl::nucleotide_char(ctl::complement_code(code));
+        }
+      }
+    }
+  }
+
+  template <typename _GenomeT>
+  std::string
+  materialize(const _GenomeT& genome) const {
+    std::string s;
+    s.reserve(ref_length + edits.size());
+    materialize(genome, s);
+    return s;
+  }
+};
+
+/// \brief Generates reads of reference length read_length sampled
+/// uniformly from the genome (which must provide size() and
+/// operator[]). Reads are returned by value by read(id) or lazily
+/// through the input iterators of reads(first, last). The genome is
+/// referenced, not copied, and must outlive the simulator.
+template <typename _GenomeT>
+class read_simulator
+{
+public:
+  read_simulator(const _GenomeT& genome, size_t read_length,
+                 error_model model, uint64_t seed, bool both_strands = false)
+    : _g {genome}, _len {read_length}, _model {model}, _seed {seed},
+      _both {both_strands} { }
+
+  read_simulator(const _GenomeT&& genome, size_t read_length,
+                 error_model model, uint64_t seed, bool both_strands = false) = delete;
+
+  const _GenomeT& genome() const { return _g; }
+
+  simulated_read
+  read(size_t id) const {
+    simulated_read r;
+    read(id, r);
+    return r;
+  }
+
+  /// \brief Simulates read id into r reusing its edit storage.
+  void
+  read(size_t id, simulated_read& r) const {
+    ctl::philox4x32 rng(_seed, id);
+    size_t G = _g.size();
+    size_t L = std::min(_len, G);
+    r.id = id;
+    r.ref_length = L;
+    r.pos = (G > L) ? static_cast<size_t>(uniform01(rng) * (G - L + 1)) : 0;
+    r.pos = std::min(r.pos, G - L);
+    r.reverse = _both && (rng() & 1);
+    r.edits.clear();
+    const double p_del = _model.del;
+    const double p_ins = p_del + _model.ins;
+    const double p_sub = p_ins + _model.sub;
+    if (p_sub <= 0.0) {
+      return;
+    }
+    for (size_t i = 0; i < L; ++i) {
+      double u = uniform01(rng);
+      if (u >= p_sub) {
+        continue;
+      }
+      uint64_t w = rng();
+      uint32_t p = static_cast<uint32_t>(i);
+      if (u < p_del) {
+        r.edits.push_back({ p, edit_type::deletion, 0 });
+      } else if (u < p_ins) {
+        r.edits.push_back({ p, edit_type::insertion, ctl::nucleotide_char(w & 3) });
+      } else {
+        // substitute with one of the three other bases
+        uint8_t c = ctl::nucleotide_code(_g[r.pos + i]);
+        uint8_t s = (c == ctl::nucleotide_invalid) ? (w & 3) : ((c + 1 + w % 3) & 3);
+        r.edits.push_back({ p, edit_type::substitution, ctl::nucleotide_char(s) });
+      }
+    }
+  }
+
+  class iterator
+  {
+  public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef simulated_read value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const simulated_read* pointer;
+    typedef const simulated_read& reference;
+
+    iterator(const read_simulator* sim, size_t id) : _sim {sim}, _id {id}, _ready {false} { }
+
+    reference operator*() { fetch(); return _r; }
+    pointer operator->() { fetch(); return &_r; }
+    iterator& operator++() { ++_id; _ready = false; return *this; }
+    bool operator==(const iterator& o) const { return _id == o._id; }
+    bool operator!=(const iterator& o) const { return _id != o._id; }
+
+  private:
+    const read_simulator* _sim;
+    size_t _id;
+    bool _ready;
+    simulated_read _r;
+
+    void fetch() { if (!_ready) { _sim->read(_id, _r); _ready = true; } }
+  };
+
+  struct range
+  {
+    iterator b;
+    iterator e;
+    iterator begin() const { return b; }
+    iterator end() const { return e; }
+  };
+
+  range reads(size_t first, size_t last) const {
+    return range { iterator(this, first), iterator(this, last) };
+  }
+
+private:
+  const _GenomeT& _g;
+  size_t _len;
+  error_model _model;
+  uint64_t _seed;
+  bool _both;
+
+  static double
+  uniform01(ctl::philox4x32& rng) {
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+  }
+};
+
+template <typename _GenomeT>
+read_simulator<_GenomeT>
+make_read_simulator(const _GenomeT& genome, size_t read_length,
+                    error_model model, uint64_t seed, bool both_strands = false) {
+  return read_simulator<_GenomeT>(genome, read_length, model, seed, both_strands);
+}
+
+template <typename _GenomeT>
+read_simulator<_GenomeT>
+make_read_simulator(const _GenomeT&& genome, size_t read_length,
+                    error_model model, uint64_t seed, bool both_strands = false) = delete;
+
+/// \brief Appends read r as a FASTA (qual == 0) or FASTQ record to out.
+/// The header is "<prefix><id> pos=<pos> strand=<+|-> edits=<n>".
+template <typename _GenomeT>
+void
+format_read(const _GenomeT& genome, const simulated_read& r, std::string& out,
+            std::string& scratch, const std::string& prefix = "read_", char qual = 0) {
+  r.materialize(genome, scratch);
+  out += qual ? '@' : '>';
+  out += prefix;
+  out += std::to_string(r.id);
+  out += " pos=";
+  out += std::to_string(r.pos);
+  out += r.reverse ? " strand=-" : " strand=+";
+  out += " edits=";
+  out += std::to_string(r.edits.size());
+  out += '\n';
+  out += scratch;
+  out += '\n';
+  if (qual) {
+    out += "+\n";
+    out.append(scratch.size(), qual);
+    out += '\n';
+  }
+}
+
+/// \brief Writes reads [first, last) to os as FASTA (qual == 0) or
+/// FASTQ with constant quality qual. Reads are simulated and formatted
+/// in batches of batch_size on a thread pool of n_threads workers (0
+/// means hardware concurrency); output is in read order and does not
+/// depend on n_threads. At most n_threads batches are held in memory.
+template <typename _StreamT, typename _GenomeT>
+void
+write_reads(_StreamT& os, const read_simulator<_GenomeT>& sim, size_t first, size_t last,
+            char qual = 0, size_t n_threads = 1, size_t batch_size = 4096,
+            const std::string& prefix = "read_") {
+  if (n_threads == 0) {
+    n_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+  }
+  batch_size = std::max<size_t>(1, batch_size);
+  std::vector<std::string> buffers(n_threads);
+  auto fill = [&sim, &prefix, qual](std::string& out, size_t b, size_t e) {
+    simulated_read r;
+    std::string scratch;
+    out.clear();
+    for (size_t id = b; id < e; ++id) {
+      sim.read(id, r);
+      format_read(sim.genome(), r, out, scratch, prefix, qual);
+    }
+  };
+  if (n_threads == 1) {
+    for (size_t id = first; id < last; id += std::min(batch_size, last - id)) {
+      fill(buffers[0], id, id + std::min(batch_size, last - id));
+      os.write(buffers[0].data(), buffers[0].size());
+    }
+    return;
+  }
+  // batch i is formatted into buffers[i % n_threads], the oldest batch
+  // is written as soon as it is ready and its buffer is reused
+  ctl::thread_pool pool(n_threads);
+  std::deque<std::future<void>> pending;
+  size_t id = first, submitted = 0;
+  auto submit = [&]() {
+    size_t e = id + std::min(batch_size, last - id);
+    std::string& out = buffers[submitted++ % n_threads];
+    pending.push_back(pool.submit([&fill, &out, b = id, e]() { fill(out, b, e); }));
+    id = e;
+  };
+  try {
+    while (id < last && pending.size() < n_threads) {
+      submit();
+    }
+    for (size_t written = 0; !pending.empty(); ++written) {
+      pending.front().get();
+      pending.pop_front();
+      const std::string& out = buffers[written % n_threads];
+      os.write(out.data(), out.size());
+      if (id < last) {
+        submit();
+      }
+    }
+  } catch (...) {
+    ctl::wait_all(pending.begin(), pending.end());
+    throw;
+  }
+}
+
+BTL_DEFAULT_NAMESPACE_END
+
+#endif
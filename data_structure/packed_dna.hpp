@@ -0,0 +1,722 @@
+// data_structure/packed_dna.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file packed_dna.hpp \brief 2 bit packed DNA storage. Bases are
+/// stored 32 per 64 bit word, base i of a word in bits [2i, 2i+2),
+/// using the codes of str/nucleotide.hpp.
+
+#include "../ctl.h"
+#include "../str/nucleotide.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifndef _CTL_PACKED_DNA_
+#define _CTL_PACKED_DNA_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+constexpr size_t packed_dna_bases_per_word = 32;
+
+/// \brief Code of base i in a packed buffer.
+inline uint8_t
+packed_code_at(const uint64_t* words, size_t i) {
+  return static_cast<uint8_t>((words[i >> 5] >> ((i & 31) << 1)) & 3);
+}
+
+/// \brief Returns the 32 bases starting at base i (that need not be word
+/// aligned) as a single word. Bases past the end of the buffer must be
+/// backed by readable memory, i.e. i + 32 <= 32 * number of words.
+inline uint64_t
+packed_word_at(const uint64_t* words, size_t i) {
+  size_t w = i >> 5;
+  unsigned sh = static_cast<unsigned>(i & 31) << 1;
+  if (sh == 0) {
+    return words[w];
+  }
+  return (words[w] >> sh) | (words[w + 1] << (64 - sh));
+}
+
+/// \brief Read only random access iterator over packed bases, yields
+/// the ASCII character of each base.
+class packed_dna_const_iterator
+{
+public:
+  typedef std::random_access_iterator_tag iterator_category;
+  typedef char value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef const char* pointer;
+  typedef char reference;
+
+  packed_dna_const_iterator() : _w {nullptr}, _i {0} { }
+  packed_dna_const_iterator(const uint64_t* w, size_t i) : _w {w}, _i {i} { }
+
+  char operator*() const { return nucleotide_char(packed_code_at(_w, _i)); }
+  char operator[](difference_type k) const { return *(*this + k); }
+  uint8_t code() const { return packed_code_at(_w, _i); }
+
+  packed_dna_const_iterator& operator++() { ++_i; return *this; }
+  packed_dna_const_iterator operator++(int) { auto t = *this; ++_i; return t; }
+  packed_dna_const_iterator& operator--() { --_i; return *this; }
+  packed_dna_const_iterator operator--(int) { auto t = *this; --_i; return t; }
+  packed_dna_const_iterator& operator+=(difference_type k) { _i += k; return *this; }
+  packed_dna_const_iterator& operator-=(difference_type k) { _i -= k; return *this; }
+
+  friend packed_dna_const_iterator
+  operator+(packed_dna_const_iterator it, difference_type k) { return it += k; }
+  friend packed_dna_const_iterator
+  operator+(difference_type k, packed_dna_const_iterator it) { return it += k; }
+  friend packed_dna_const_iterator
+  operator-(packed_dna_const_iterator it, difference_type k) { return it -= k; }
+  friend difference_type
+  operator-(const packed_dna_const_iterator& a, const packed_dna_const_iterator& b) {
+    return static_cast<difference_type>(a._i) - static_cast<difference_type>(b._i);
+  }
+
+  bool operator==(const packed_dna_const_iterator& o) const { return _i == o._i && _w == o._w; }
+  bool operator!=(const packed_dna_const_iterator& o) const { return !(*this == o); }
+  bool operator<(const packed_dna_const_iterator& o) const { return _i < o._i; }
+  bool operator>(const packed_dna_const_iterator& o) const { return _i > o._i; }
+  bool operator<=(const packed_dna_const_iterator& o) const { return _i <= o._i; }
+  bool operator>=(const packed_dna_const_iterator& o) const { return _i >= o._i; }
+
+  const uint64_t* words() const { return _w; }
+  size_t index() const { return _i; }
+
+private:
+  const uint64_t* _w;
+  size_t _i;
+};
+
+/// \brief Zero-copy view over a range of a packed buffer. Provides
+/// size(), operator[] and iterators so that the templates in str/ work
+/// unchanged. A view can be built from an iterator pair of another
+/// view, which is what kmer_statistics does to build its keys.
+class packed_dna_view
+{
+public:
+  typedef char value_type;
+  typedef size_t size_type;
+  typedef packed_dna_const_iterator const_iterator;
+  typedef packed_dna_const_iterator iterator;
+
+  packed_dna_view() : _w {nullptr}, _off {0}, _n {0} { }
+  packed_dna_view(const uint64_t* words, size_t n, size_t offset = 0)
+    : _w {words}, _off {offset}, _n {n} { }
+  packed_dna_view(const_iterator b, const_iterator e)
+    : _w {b.words()}, _off {b.index()}, _n {static_cast<size_t>(e - b)} { }
+
+  size_type size() const { return _n; }
+  bool empty() const { return _n == 0; }
+  char operator[](size_t i) const { return nucleotide_char(code(i)); }
+  uint8_t code(size_t i) const { return packed_code_at(_w, _off + i); }
+
+  const_iterator begin() const { return const_iterator(_w, _off); }
+  const_iterator end() const { return const_iterator(_w, _off + _n); }
+
+  packed_dna_view
+  substr(size_t pos, size_t len) const {
+    return packed_dna_view(_w, std::min(len, _n - pos), _off + pos);
+  }
+
+  std::string
+  str() const {
+    std::string s(_n, 'A');
+    for (size_t i = 0; i < _n; ++i) {
+      s[i] = (*this)[i];
+    }
+    return s;
+  }
+
+  const uint64_t* words() const { return _w; }
+  size_t offset() const { return _off; }
+
+  friend bool
+  operator==(const packed_dna_view& a, const packed_dna_view& b) {
+    if (a._n != b._n) {
+      return false;
+    }
+    size_t i = 0;
+    for (; i + 32 <= a._n; i += 32) {
+      if (packed_word_at(a._w, a._off + i) != packed_word_at(b._w, b._off + i)) {
+        return false;
+      }
+    }
+    for (; i < a._n; ++i) {
+      if (a.code(i) != b.code(i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  friend bool
+  operator!=(const packed_dna_view& a, const packed_dna_view& b) { return !(a == b); }
+
+  friend bool
+  operator<(const packed_dna_view& a, const packed_dna_view& b) {
+    size_t n = std::min(a._n, b._n);
+    for (size_t i = 0; i < n; ++i) {
+      uint8_t x = a.code(i), y = b.code(i);
+      if (x != y) {
+        return x < y;
+      }
+    }
+    return a._n < b._n;
+  }
+
+private:
+  const uint64_t* _w;
+  size_t _off;
+  size_t _n;
+};
+
+/// \brief Run of identical non ACGT characters of a packed_dna (the
+/// packed words hold code 0, i.e. A, at these positions).
+struct packed_dna_ambiguous
+{
+  size_t pos;
+  size_t len;
+  char base;
+
+  bool operator==(const packed_dna_ambiguous& o) const {
+    return pos == o.pos && len == o.len && base == o.base;
+  }
+};
+
+class packed_dna;
+
+/// \brief Proxy returned by the mutable operator[] and iterators of
+/// packed_dna, converts to char and assigns a char.
+class packed_dna_reference
+{
+public:
+  packed_dna_reference(packed_dna* c, size_t i) : _c {c}, _i {i} { }
+
+  inline operator char() const;
+  inline packed_dna_reference& operator=(char c);
+  packed_dna_reference& operator=(const packed_dna_reference& o) { return *this = static_cast<char>(o); }
+  inline uint8_t code() const;
+
+  friend void
+  swap(packed_dna_reference a, packed_dna_reference b) {
+    char t = a;
+    a = static_cast<char>(b);
+    b = t;
+  }
+
+private:
+  packed_dna* _c;
+  size_t _i;
+};
+
+/// \brief Random access iterator over a packed_dna (aware of ambiguous
+/// bases), yields char when _Const and packed_dna_reference otherwise.
+template <bool _Const>
+class packed_dna_iterator
+{
+public:
+  typedef std::random_access_iterator_tag iterator_category;
+  typedef char value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef void pointer;
+  typedef typename std::conditional<_Const, char, packed_dna_reference>::type reference;
+  typedef typename std::conditional<_Const, const packed_dna*, packed_dna*>::type container_pointer;
+
+  packed_dna_iterator() : _c {nullptr}, _i {0} { }
+  packed_dna_iterator(container_pointer c, size_t i) : _c {c}, _i {i} { }
+  template <bool _C2, typename = typename std::enable_if<_Const && !_C2>::type>
+  packed_dna_iterator(const packed_dna_iterator<_C2>& o) : _c {o.container()}, _i {o.index()} { }
+
+  inline reference operator*() const;
+  reference operator[](difference_type k) const { return *(*this + k); }
+
+  packed_dna_iterator& operator++() { ++_i; return *this; }
+  packed_dna_iterator operator++(int) { auto t = *this; ++_i; return t; }
+  packed_dna_iterator& operator--() { --_i; return *this; }
+  packed_dna_iterator operator--(int) { auto t = *this; --_i; return t; }
+  packed_dna_iterator& operator+=(difference_type k) { _i += k; return *this; }
+  packed_dna_iterator& operator-=(difference_type k) { _i -= k; return *this; }
+
+  friend packed_dna_iterator
+  operator+(packed_dna_iterator it, difference_type k) { return it += k; }
+  friend packed_dna_iterator
+  operator+(difference_type k, packed_dna_iterator it) { return it += k; }
+  friend packed_dna_iterator
+  operator-(packed_dna_iterator it, difference_type k) { return it -= k; }
+  friend difference_type
+  operator-(const packed_dna_iterator& a, const packed_dna_iterator& b) {
+    return static_cast<difference_type>(a._i) - static_cast<difference_type>(b._i);
+  }
+
+  bool operator==(const packed_dna_iterator& o) const { return _i == o._i && _c == o._c; }
+  bool operator!=(const packed_dna_iterator& o) const { return !(*this == o); }
+  bool operator<(const packed_dna_iterator& o) const { return _i < o._i; }
+  bool operator>(const packed_dna_iterator& o) const { return _i > o._i; }
+  bool operator<=(const packed_dna_iterator& o) const { return _i <= o._i; }
+  bool operator>=(const packed_dna_iterator& o) const { return _i >= o._i; }
+
+  container_pointer container() const { return _c; }
+  size_t index() const { return _i; }
+
+private:
+  container_pointer _c;
+  size_t _i;
+};
+
+/// \brief Owning 2 bit packed DNA sequence with a string-like interface
+/// (size(), operator[], iterators, push_back, resize, insert) so that
+/// the templates written for std::string work unchanged, at a quarter
+/// of the memory. Characters other than ACGT are kept in a sorted side
+/// list of runs (ambiguous()) and read back as they were; the packed
+/// words store A for them. Lower case ACGT are stored upper case.
+class packed_dna
+{
+public:
+  typedef char value_type;
+  typedef size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef packed_dna_reference reference;
+  typedef char const_reference;
+  typedef packed_dna_iterator<false> iterator;
+  typedef packed_dna_iterator<true> const_iterator;
+
+  packed_dna() : _words(1, 0), _n {0} { }
+  explicit packed_dna(size_t n)
+    : _words(words_for(n) + 1, 0), _n {n} { }
+  packed_dna(size_t n, char c) : packed_dna() { resize(n, c); }
+  packed_dna(const std::string& s) : packed_dna() { assign(s.data(), s.size()); }
+  packed_dna(const char* s) : packed_dna() { assign(s, std::char_traits<char>::length(s)); }
+
+  template <typename _IterT,
+            typename = typename std::iterator_traits<_IterT>::iterator_category>
+  packed_dna(_IterT b, _IterT e) : packed_dna() { assign(b, e); }
+
+  size_type size() const { return _n; }
+  size_type length() const { return _n; }
+  bool empty() const { return _n == 0; }
+
+  char
+  operator[](size_t i) const {
+    if (!_amb.empty()) {
+      size_t r = find_run(i);
+      if (r != npos) {
+        return _amb[r].base;
+      }
+    }
+    return nucleotide_char(packed_code_at(_words.data(), i));
+  }
+
+  reference operator[](size_t i) { return reference(this, i); }
+  char front() const { return (*this)[0]; }
+  char back() const { return (*this)[_n - 1]; }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, _n); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, _n); }
+
+  /// \brief Code of base i (0 for ambiguous bases)
+  uint8_t code(size_t i) const { return packed_code_at(_words.data(), i); }
+
+  /// \brief Sets base i to a valid code, dropping any ambiguity there
+  void
+  set_code(size_t i, uint8_t c) {
+    size_t w = i / packed_dna_bases_per_word;
+    unsigned sh = static_cast<unsigned>(i % packed_dna_bases_per_word) * 2;
+    _words[w] = (_words[w] & ~(uint64_t(3) << sh)) | (uint64_t(c & 3) << sh);
+    if (!_amb.empty()) {
+      erase_ambiguous(i);
+    }
+  }
+
+  /// \brief Sets base i to the character c (any character)
+  void
+  set(size_t i, char c) {
+    uint8_t code = nucleotide_code(c);
+    if (code != nucleotide_invalid) {
+      set_code(i, code);
+    } else {
+      set_code(i, 0);
+      insert_ambiguous(i, c);
+    }
+  }
+
+  void
+  push_back(char c) {
+    if (_n % packed_dna_bases_per_word == 0 && _words.size() < words_for(_n + 1) + 1) {
+      _words.push_back(0);
+    }
+    ++_n;
+    set(_n - 1, c);
+  }
+
+  void
+  pop_back() {
+    resize(_n - 1);
+  }
+
+  /// \brief Inserts c before pos, O(1) at the end and O(n) elsewhere
+  iterator
+  insert(const_iterator pos, char c) {
+    size_t i = pos.index();
+    if (i == _n) {
+      push_back(c);
+      return iterator(this, i);
+    }
+    std::string tail = substr(i, _n - i);
+    resize(i);
+    push_back(c);
+    append(tail.data(), tail.size());
+    return iterator(this, i);
+  }
+
+  void
+  resize(size_t n, char c = 'A') {
+    if (n < _n) {
+      _words.resize(words_for(n) + 1);
+      _words.back() = 0;
+      _n = n;
+      clear_tail();
+      while (!_amb.empty() && _amb.back().pos >= n) {
+        _amb.pop_back();
+      }
+      if (!_amb.empty() && _amb.back().pos + _amb.back().len > n) {
+        _amb.back().len = n - _amb.back().pos;
+      }
+      return;
+    }
+    size_t old = _n;
+    _words.resize(words_for(n) + 1, 0);
+    _n = n;
+    uint8_t code = nucleotide_code(c);
+    if (code != 0 && code != nucleotide_invalid) {
+      for (size_t i = old; i < n; ++i) {
+        set_code(i, code);
+      }
+    } else if (code == nucleotide_invalid && n > old) {
+      append_run(old, n - old, c);
+    }
+  }
+
+  void reserve(size_t n) { _words.reserve(words_for(n) + 1); }
+
+  void
+  clear() {
+    _words.assign(1, 0);
+    _amb.clear();
+    _n = 0;
+  }
+
+  /// \brief Replaces the content with the characters of [b, e)
+  template <typename _IterT>
+  void
+  assign(_IterT b, _IterT e) {
+    clear();
+    if constexpr (std::is_same<typename std::iterator_traits<_IterT>::iterator_category,
+                               std::random_access_iterator_tag>::value) {
+      reserve(static_cast<size_t>(std::distance(b, e)));
+    }
+    for (; b != e; ++b) {
+      push_back(*b);
+    }
+  }
+
+  /// \brief Bulk packing of n ASCII characters, 32 per word
+  void
+  assign(const char* s, size_t n) {
+    clear();
+    append(s, n);
+  }
+
+  void
+  append(const char* s, size_t n) {
+    const size_t start = _n;
+    _words.resize(words_for(start + n) + 1, 0);
+    _n = start + n;
+    size_t i = 0;
+    // bases up to the next word boundary
+    for (; i < n && (start + i) % packed_dna_bases_per_word != 0; ++i) {
+      set(start + i, s[i]);
+    }
+    uint64_t* out = _words.data() + (start + i) / packed_dna_bases_per_word;
+    for (; i + packed_dna_bases_per_word <= n; i += packed_dna_bases_per_word) {
+      uint64_t w = 0;
+      uint8_t bad = 0;
+      for (unsigned k = 0; k < packed_dna_bases_per_word; ++k) {
+        uint8_t c = nucleotide_table[static_cast<uint8_t>(s[i + k])];
+        bad |= c;
+        w |= static_cast<uint64_t>(c & 3) << (2 * k);
+      }
+      if (bad & nucleotide_invalid) {
+        // fix the word and record the ambiguous runs
+        w = 0;
+        for (unsigned k = 0; k < packed_dna_bases_per_word; ++k) {
+          uint8_t c = nucleotide_code(s[i + k]);
+          if (c == nucleotide_invalid) {
+            append_run(start + i + k, 1, s[i + k]);
+            c = 0;
+          }
+          w |= static_cast<uint64_t>(c) << (2 * k);
+        }
+      }
+      *out++ = w;
+    }
+    for (; i < n; ++i) {
+      set(start + i, s[i]);
+    }
+  }
+
+  void append(const std::string& s) { append(s.data(), s.size()); }
+
+  /// \brief Bulk unpacking of len characters from pos into out
+  void
+  unpack(char* out, size_t pos, size_t len) const {
+    static const std::array<uint32_t, 256> quad = make_quad_table();
+    size_t i = pos, e = pos + len;
+    for (; i < e && i % 4 != 0; ++i) {
+      *out++ = nucleotide_char(code(i));
+    }
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(_words.data());
+    for (; i + 4 <= e; i += 4) {
+      // 4 bases per byte (little endian word layout)
+      uint32_t q = quad[bytes[i / 4]];
+      std::memcpy(out, &q, 4);
+      out += 4;
+    }
+    for (; i < e; ++i) {
+      *out++ = nucleotide_char(code(i));
+    }
+    out -= len;
+    for (const packed_dna_ambiguous& r : _amb) {
+      size_t b = std::max(r.pos, pos), f = std::min(r.pos + r.len, e);
+      for (size_t k = b; k < f; ++k) {
+        out[k - pos] = r.base;
+      }
+    }
+  }
+
+  std::string
+  substr(size_t pos, size_t len = std::string::npos) const {
+    len = std::min(len, _n - pos);
+    std::string s(len, 'A');
+    if (len > 0) {
+      unpack(&s[0], pos, len);
+    }
+    return s;
+  }
+
+  std::string str() const { return substr(0); }
+
+  /// \brief Sorted runs of non ACGT characters
+  const std::vector<packed_dna_ambiguous>& ambiguous() const { return _amb; }
+
+  packed_dna_view view() const { return packed_dna_view(_words.data(), _n); }
+
+  /// \brief Packed words, one spare zero word follows the last one so
+  /// that packed_word_at() can be used at any position. Bits past the
+  /// last base are kept at zero.
+  uint64_t* data() { return _words.data(); }
+  const uint64_t* data() const { return _words.data(); }
+  size_t word_count() const { return words_for(_n); }
+  uint64_t word(size_t w) const { return _words[w]; }
+  /// \brief The 32 codes starting at base i (not necessarily aligned)
+  uint64_t word_at(size_t i) const { return packed_word_at(_words.data(), i); }
+
+  /// \brief Clears the unused high bits of the last word (needed after
+  /// writing the words through data()).
+  void
+  trim() {
+    clear_tail();
+    _words.back() = 0;
+  }
+
+  friend bool
+  operator==(const packed_dna& a, const packed_dna& b) {
+    return a._n == b._n && a._amb == b._amb
+      && std::equal(a._words.begin(), a._words.begin() + a.word_count(), b._words.begin());
+  }
+  friend bool operator!=(const packed_dna& a, const packed_dna& b) { return !(a == b); }
+  friend bool
+  operator<(const packed_dna& a, const packed_dna& b) {
+    return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+  }
+
+private:
+  static constexpr size_t npos = static_cast<size_t>(-1);
+  std::vector<uint64_t> _words;
+  std::vector<packed_dna_ambiguous> _amb;
+  size_t _n;
+
+  static size_t
+  words_for(size_t n) {
+    return (n + packed_dna_bases_per_word - 1) / packed_dna_bases_per_word;
+  }
+
+  static std::array<uint32_t, 256>
+  make_quad_table() {
+    std::array<uint32_t, 256> t {};
+    for (unsigned b = 0; b < 256; ++b) {
+      char c[4];
+      for (unsigned k = 0; k < 4; ++k) {
+        c[k] = nucleotide_char(static_cast<uint8_t>((b >> (2 * k)) & 3));
+      }
+      std::memcpy(&t[b], c, 4);
+    }
+    return t;
+  }
+
+  void
+  clear_tail() {
+    size_t r = _n % packed_dna_bases_per_word;
+    if (r != 0) {
+      _words[_n / packed_dna_bases_per_word] &= (uint64_t(1) << (2 * r)) - 1;
+    }
+  }
+
+  size_t
+  find_run(size_t i) const {
+    auto it = std::upper_bound(_amb.begin(), _amb.end(), i,
+                               [](size_t x, const packed_dna_ambiguous& r) { return x < r.pos; });
+    if (it == _amb.begin()) {
+      return npos;
+    }
+    --it;
+    return (i < it->pos + it->len) ? static_cast<size_t>(it - _amb.begin()) : npos;
+  }
+
+  // appends a run starting at or after the end of the last one
+  void
+  append_run(size_t pos, size_t len, char c) {
+    if (!_amb.empty() && _amb.back().base == c && _amb.back().pos + _amb.back().len == pos) {
+      _amb.back().len += len;
+    } else {
+      _amb.push_back(packed_dna_ambiguous {pos, len, c});
+    }
+  }
+
+  void
+  erase_ambiguous(size_t i) {
+    size_t r = find_run(i);
+    if (r == npos) {
+      return;
+    }
+    packed_dna_ambiguous run = _amb[r];
+    std::vector<packed_dna_ambiguous> parts;
+    if (i > run.pos) {
+      parts.push_back(packed_dna_ambiguous {run.pos, i - run.pos, run.base});
+    }
+    if (i + 1 < run.pos + run.len) {
+      parts.push_back(packed_dna_ambiguous {i + 1, run.pos + run.len - i - 1, run.base});
+    }
+    _amb.erase(_amb.begin() + r);
+    _amb.insert(_amb.begin() + r, parts.begin(), parts.end());
+  }
+
+  void
+  insert_ambiguous(size_t i, char c) {
+    if (_amb.empty() || _amb.back().pos + _amb.back().len <= i) {
+      append_run(i, 1, c);
+      return;
+    }
+    auto it = std::upper_bound(_amb.begin(), _amb.end(), i,
+                               [](size_t x, const packed_dna_ambiguous& r) { return x < r.pos; });
+    size_t r = static_cast<size_t>(it - _amb.begin());
+    // merge with the runs ending at i or starting at i + 1
+    bool left = r > 0 && _amb[r - 1].base == c && _amb[r - 1].pos + _amb[r - 1].len == i;
+    bool right = r < _amb.size() && _amb[r].base == c && _amb[r].pos == i + 1;
+    if (left && right) {
+      _amb[r - 1].len += 1 + _amb[r].len;
+      _amb.erase(_amb.begin() + r);
+    } else if (left) {
+      ++_amb[r - 1].len;
+    } else if (right) {
+      --_amb[r].pos;
+      ++_amb[r].len;
+    } else {
+      _amb.insert(_amb.begin() + r, packed_dna_ambiguous {i, 1, c});
+    }
+  }
+};
+
+packed_dna_reference::operator char() const {
+  return static_cast<const packed_dna&>(*_c)[_i];
+}
+
+packed_dna_reference&
+packed_dna_reference::operator=(char c) {
+  _c->set(_i, c);
+  return *this;
+}
+
+uint8_t
+packed_dna_reference::code() const {
+  return _c->code(_i);
+}
+
+template <bool _Const>
+typename packed_dna_iterator<_Const>::reference
+packed_dna_iterator<_Const>::operator*() const {
+  if constexpr (_Const) {
+    return (*_c)[_i];
+  } else {
+    return packed_dna_reference(_c, _i);
+  }
+}
+
+/// \brief Packs 32 codes (one per byte) into a word.
+inline uint64_t
+pack_codes32(const uint8_t* codes) {
+  uint64_t w = 0;
+  for (unsigned i = 0; i < 32; ++i) {
+    w |= static_cast<uint64_t>(codes[i] & 3) << (2 * i);
+  }
+  return w;
+}
+
+CTL_DEFAULT_NAMESPACE_END
+
+namespace std {
+
+template <>
+struct hash<ctl::packed_dna>
+{
+  size_t
+  operator()(const ctl::packed_dna& s) const {
+    uint64_t h = 1469598103934665603ULL ^ s.size();
+    for (size_t w = 0; w < s.word_count(); ++w) {
+      h = (h ^ s.word(w)) * 1099511628211ULL;
+    }
+    for (const auto& r : s.ambiguous()) {
+      h = (h ^ (r.pos * 31 + static_cast<unsigned char>(r.base))) * 1099511628211ULL;
+    }
+    return static_cast<size_t>(h);
+  }
+};
+
+} // namespace std
+
+#endif
@@ -0,0 +1,124 @@
+// io/mapped_file.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file mapped_file.hpp \brief Read only memory mapped files (POSIX).
+
+#include "../ctl.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef _CTL_MAPPED_FILE_
+#define _CTL_MAPPED_FILE_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+/// \brief Move only RAII wrapper of a read only, shared mapping of a
+/// whole file. Errors are reported as std::system_error.
+class mapped_file
+{
+public:
+  mapped_file() : _data {nullptr}, _size {0} { }
+
+  explicit mapped_file(const std::string& path, bool sequential = false)
+    : _data {nullptr}, _size {0}
+  {
+    open(path, sequential);
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  mapped_file(mapped_file&& o) noexcept
+    : _data {o._data}, _size {o._size}
+  {
+    o._data = nullptr;
+    o._size = 0;
+  }
+
+  mapped_file&
+  operator=(mapped_file&& o) noexcept {
+    if (this != &o) {
+      close();
+      std::swap(_data, o._data);
+      std::swap(_size, o._size);
+    }
+    return *this;
+  }
+
+  ~mapped_file() { close(); }
+
+  void
+  open(const std::string& path, bool sequential = false) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      int err = errno;
+      ::close(fd);
+      throw std::system_error(err, std::generic_category(), "fstat " + path);
+    }
+    _size = static_cast<size_t>(st.st_size);
+    if (_size > 0) {
+      void* p = ::mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        int err = errno;
+        ::close(fd);
+        _size = 0;
+        throw std::system_error(err, std::generic_category(), "mmap " + path);
+      }
+      _data = static_cast<const char*>(p);
+      if (sequential) {
+        ::madvise(p, _size, MADV_SEQUENTIAL);
+      }
+    }
+    ::close(fd);
+  }
+
+  void
+  close() {
+    if (_data) {
+      ::munmap(const_cast<char*>(_data), _size);
+    }
+    _data = nullptr;
+    _size = 0;
+  }
+
+  bool is_open() const { return _data != nullptr; }
+  const char* data() const { return _data; }
+  size_t size() const { return _size; }
+  std::string_view view() const { return std::string_view(_data, _size); }
+
+private:
+  const char* _data;
+  size_t _size;
+};
+
+CTL_DEFAULT_NAMESPACE_END
+
+#endif
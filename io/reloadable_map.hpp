@@ -0,0 +1,358 @@
+// io/reloadable_map.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file reloadable_map.hpp \brief Key value map loaded from a file
+/// with stream_to_map and reloaded when the file changes. Readers get
+/// immutable snapshots without taking locks: the current snapshot is
+/// an atomic pointer and old snapshots are reclaimed with epochs (RCU
+/// style) once no reader can still hold them.
+///
+/// A reload that cannot open or read the file, or sees it change while
+/// reading, keeps the current snapshot. A partially written file that
+/// reads fine cannot be detected, hence writers must replace the file
+/// atomically: write a temporary file in the same directory and
+/// rename() it over the watched path.
+
+#include "../ctl.h"
+#include "stream_map.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#ifndef _CTL_RELOADABLE_MAP_
+#define _CTL_RELOADABLE_MAP_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+template <typename _MapT = std::map<std::string, std::string>>
+class reloadable_map
+{
+public:
+  typedef _MapT map_type;
+  typedef typename _MapT::key_type key_type;
+  typedef typename _MapT::mapped_type mapped_type;
+
+  /// \brief Immutable content published to readers, version increases
+  /// by one at every reload.
+  struct snapshot
+  {
+    map_type map;
+    uint64_t version;
+  };
+
+  /// \brief Pins the snapshot current at construction, must not
+  /// outlive the map. Guards are cheap: one slot claim and two atomic
+  /// stores, no locks. When all the slots are taken (more than 128 live
+  /// guards) the guard is registered under a mutex instead.
+  class read_guard
+  {
+  public:
+    read_guard(const read_guard&) = delete;
+    read_guard& operator=(const read_guard&) = delete;
+    read_guard(read_guard&& o) noexcept
+      : _owner {o._owner}, _slot {o._slot}, _pin {o._pin}, _snap {o._snap} {
+      o._owner = nullptr;
+      o._slot = nullptr;
+    }
+    ~read_guard() {
+      if (_slot) {
+        _slot->epoch.store(0, std::memory_order_release);
+        _slot->used.store(false, std::memory_order_release);
+      } else if (_owner) {
+        std::lock_guard<std::mutex> lk(_owner->_overflow_m);
+        _owner->_overflow.erase(_pin);
+      }
+    }
+
+    const snapshot& operator*() const { return *_snap; }
+    const snapshot* operator->() const { return _snap; }
+    const map_type& map() const { return _snap->map; }
+    uint64_t version() const { return _snap->version; }
+
+  private:
+    friend class reloadable_map;
+    read_guard(typename reloadable_map::slot* s, const snapshot* p)
+      : _owner {nullptr}, _slot {s}, _snap {p} { }
+    read_guard(const reloadable_map* owner, std::multiset<uint64_t>::iterator pin,
+               const snapshot* p)
+      : _owner {owner}, _slot {nullptr}, _pin {pin}, _snap {p} { }
+    const reloadable_map* _owner;
+    typename reloadable_map::slot* _slot;
+    std::multiset<uint64_t>::iterator _pin;
+    const snapshot* _snap;
+  };
+
+  /// \brief Loads path (throws std::runtime_error if it cannot be read)
+  /// and, if poll_interval is positive, starts a thread that checks the
+  /// file modification time and size every poll_interval and reloads it
+  /// when they change.
+  explicit reloadable_map(const std::string& path, char delimiter = '=', char comment = '#',
+                          std::chrono::milliseconds poll_interval = std::chrono::milliseconds(1000))
+    : _path {path}, _delimiter {delimiter}, _comment {comment}, _interval {poll_interval},
+      _current {nullptr}, _epoch {1}, _version {0}, _stamp {0, 0}, _stop {false}
+  {
+    for (auto& s : _slots) {
+      s.epoch.store(0);
+    }
+    _stamp = file_stamp();
+    snapshot* s = load();
+    if (!s) {
+      throw std::runtime_error("reloadable_map: cannot read " + _path);
+    }
+    publish(s);
+    if (_interval.count() > 0) {
+      _watcher = std::thread([this]() { watch(); });
+    }
+  }
+
+  reloadable_map(const reloadable_map&) = delete;
+  reloadable_map& operator=(const reloadable_map&) = delete;
+
+  ~reloadable_map() {
+    if (_watcher.joinable()) {
+      {
+        std::lock_guard<std::mutex> lk(_m);
+        _stop = true;
+      }
+      _cv.notify_all();
+      _watcher.join();
+    }
+    delete _current.load();
+    for (auto& r : _retired) {
+      delete r.first;
+    }
+  }
+
+  /// \brief Returns a guard on the current snapshot (lock free).
+  read_guard
+  read() const {
+    slot* s = claim();
+    if (!s) {
+      // every slot is taken, reclaim() reads the pins under the same lock
+      std::lock_guard<std::mutex> lk(_overflow_m);
+      auto pin = _overflow.insert(_epoch.load(std::memory_order_seq_cst));
+      return read_guard(this, pin, _current.load(std::memory_order_seq_cst));
+    }
+    // the epoch must be visible before the pointer is loaded, so that a
+    // concurrent reload either sees this reader or is seen by it
+    s->epoch.store(_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+    const snapshot* p = _current.load(std::memory_order_seq_cst);
+    return read_guard(s, p);
+  }
+
+  uint64_t version() const { return _version.load(); }
+
+  /// \brief Reloads the file if its modification time or size changed,
+  /// returns true if a new snapshot was published. A file that is
+  /// missing, unreadable or changing while read is retried at the next
+  /// call, the current snapshot is kept meanwhile.
+  bool
+  reload_if_changed() {
+    std::lock_guard<std::mutex> lk(_reload_m);
+    auto st = file_stamp();
+    if (st == _stamp) {
+      return false;
+    }
+    return try_reload(st);
+  }
+
+  /// \brief Unconditionally reloads the file, throws std::runtime_error
+  /// (keeping the current snapshot) if it cannot be read.
+  void
+  reload() {
+    std::lock_guard<std::mutex> lk(_reload_m);
+    if (!try_reload(file_stamp())) {
+      throw std::runtime_error("reloadable_map: cannot read " + _path);
+    }
+  }
+
+private:
+  struct alignas(64) slot
+  {
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> used {false};
+  };
+
+  static constexpr size_t n_slots = 128;
+
+  std::string _path;
+  char _delimiter;
+  char _comment;
+  std::chrono::milliseconds _interval;
+  std::atomic<const snapshot*> _current;
+  std::atomic<uint64_t> _epoch;
+  std::atomic<uint64_t> _version;
+  std::pair<int64_t, int64_t> _stamp;
+  mutable slot _slots[n_slots];
+  mutable std::mutex _overflow_m;
+  mutable std::multiset<uint64_t> _overflow;
+  std::vector<std::pair<const snapshot*, uint64_t>> _retired;
+  std::mutex _reload_m;
+  std::mutex _m;
+  std::condition_variable _cv;
+  bool _stop;
+  std::thread _watcher;
+
+  // a free slot, nullptr after one pass over the taken slots
+  slot*
+  claim() const {
+    for (size_t i = 0; i < n_slots; ++i) {
+      bool expected = false;
+      if (!_slots[i].used.load(std::memory_order_relaxed)
+          && _slots[i].used.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+        return &_slots[i];
+      }
+    }
+    return nullptr;
+  }
+
+  // a new (unpublished) snapshot, nullptr if the file cannot be read
+  snapshot*
+  load() {
+    std::ifstream is(_path);
+    if (!is.is_open()) {
+      return nullptr;
+    }
+    std::unique_ptr<snapshot> s(new snapshot);
+    s->map = stream_to_map<key_type, mapped_type, map_type>(is, _delimiter, _comment);
+    if (is.bad()) {
+      return nullptr;
+    }
+    return s.release();
+  }
+
+  // called with _reload_m held, st is the stamp seen before loading
+  bool
+  try_reload(std::pair<int64_t, int64_t> st) {
+    if (st.first < 0) {
+      return false;
+    }
+    snapshot* s = load();
+    if (!s || file_stamp() != st) {
+      delete s;
+      return false;
+    }
+    _stamp = st;
+    publish(s);
+    return true;
+  }
+
+  // called with _reload_m held (or from the constructor)
+  void
+  publish(snapshot* s) {
+    s->version = ++_version;
+    const snapshot* old = _current.exchange(s, std::memory_order_seq_cst);
+    uint64_t e = _epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+    if (old) {
+      _retired.emplace_back(old, e);
+    }
+    reclaim();
+  }
+
+  // frees the retired snapshots no active reader can reference: those
+  // retired at epoch e are safe once every reader announced an epoch
+  // >= e (or none at all)
+  void
+  reclaim() {
+    uint64_t min_active = UINT64_MAX;
+    for (auto& s : _slots) {
+      uint64_t e = s.epoch.load(std::memory_order_seq_cst);
+      if (e != 0 && e < min_active) {
+        min_active = e;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lk(_overflow_m);
+      if (!_overflow.empty()) {
+        min_active = std::min(min_active, *_overflow.begin());
+      }
+    }
+    size_t w = 0;
+    for (auto& r : _retired) {
+      if (r.second <= min_active) {
+        delete r.first;
+      } else {
+        _retired[w++] = r;
+      }
+    }
+    _retired.resize(w);
+  }
+
+  std::pair<int64_t, int64_t>
+  file_stamp() const {
+    struct stat st;
+    if (::stat(_path.c_str(), &st) != 0) {
+      return { -1, -1 };
+    }
+    return { static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+             static_cast<int64_t>(st.st_size) };
+  }
+
+  void
+  watch() {
+    std::unique_lock<std::mutex> lk(_m);
+    while (!_cv.wait_for(lk, _interval, [this]() { return _stop; })) {
+      lk.unlock();
+      reload_if_changed();
+      lk.lock();
+    }
+  }
+};
+
+/// \brief Per thread cache of a typed lookup: the value is converted
+/// with from_string only when the snapshot version changes. Not thread
+/// safe, each reader thread keeps its own instances.
+template <typename _T, typename _MapT = std::map<std::string, std::string>>
+class cached_value
+{
+public:
+  cached_value(std::string key, _T default_value)
+    : _key {std::move(key)}, _default {default_value}, _value {default_value}, _version {0} { }
+
+  const _T&
+  get(const typename reloadable_map<_MapT>::read_guard& g) {
+    if (g.version() != _version) {
+      auto it = g.map().find(_key);
+      _value = (it == g.map().end()) ? _default : from_string<_T>(it->second);
+      _version = g.version();
+    }
+    return _value;
+  }
+
+private:
+  std::string _key;
+  _T _default;
+  _T _value;
+  uint64_t _version;
+};
+
+CTL_DEFAULT_NAMESPACE_END
+
+#endif
@@ -19,12 +19,23 @@
 /// factory function allowing working directly with file
 
 #include "../ctl.h"
+#include "mapped_file.hpp"
+#include "../thread/thread_pool.hpp"
 
 #include <map>
 #include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #ifndef _CTL_STREAM_MAP_
 #define _CTL_STREAM_MAP_
@@ -32,45 +43,273 @@
 
 CTL_DEFAULT_NAMESPACE_BEGIN
 
-/// \fn _T from_string(std::string str)
-/// \brief converts a string to type _T using operator >>.
+/// \fn bool parse_value(std::string_view str, _T& t)
+/// \brief converts str to type _T without allocating: arithmetic types
+/// use std::from_chars (surrounding blanks are ignored), strings are
+/// copied as they are, other types fall back to operator >>. Returns
+/// false if str could not be converted.
 template <typename _T>
-_T from_string(std::string str) {
-  std::stringstream _stream{ str };
-  _T t;
-  _stream >> t;
+bool
+parse_value(std::string_view str, _T& t) {
+  if constexpr (std::is_same<_T, bool>::value) {
+    long v = 0;
+    bool ok = parse_value(str, v);
+    t = (v != 0);
+    return ok;
+  } else if constexpr (std::is_arithmetic<_T>::value) {
+    const char* b = str.data();
+    const char* e = b + str.size();
+    while (b < e && std::isspace(static_cast<unsigned char>(*b))) { ++b; }
+    while (e > b && std::isspace(static_cast<unsigned char>(*(e - 1)))) { --e; }
+    if (b < e && *b == '+') { ++b; }
+    auto res = std::from_chars(b, e, t);
+    return res.ec == std::errc();
+  } else if constexpr (std::is_same<_T, std::string>::value) {
+    t.assign(str.data(), str.size());
+    return true;
+  } else {
+    std::stringstream _stream{ std::string(str) };
+    _stream >> t;
+    return !_stream.fail();
+  }
+}
+
+/// \fn _T from_string(std::string_view str)
+/// \brief converts a string to type _T (see parse_value).
+template <typename _T>
+_T from_string(std::string_view str) {
+  _T t {};
+  parse_value(str, t);
   return t;
 }
 
 template<>
 inline std::string
-from_string<std::string>(std::string str) {
-  // hopefully compiler will optimize
-  return  str;
+from_string<std::string>(std::string_view str) {
+  return std::string(str);
+}
+
+/// \brief Sorted vector of key value pairs with a map-like lookup
+/// interface. Faster to build in bulk and to scan than std::map.
+template <typename _KeyT, typename _ValT>
+class flat_map
+{
+public:
+  typedef _KeyT key_type;
+  typedef _ValT mapped_type;
+  typedef std::pair<_KeyT, _ValT> value_type;
+  typedef typename std::vector<value_type>::const_iterator const_iterator;
+  typedef typename std::vector<value_type>::iterator iterator;
+
+  size_t size() const { return _v.size(); }
+  bool empty() const { return _v.empty(); }
+  const_iterator begin() const { return _v.begin(); }
+  const_iterator end() const { return _v.end(); }
+  iterator begin() { return _v.begin(); }
+  iterator end() { return _v.end(); }
+
+  const_iterator
+  find(const _KeyT& k) const {
+    auto it = lower(k);
+    return (it != _v.end() && !(k < it->first)) ? it : _v.end();
+  }
+
+  size_t count(const _KeyT& k) const { return find(k) == end() ? 0 : 1; }
+
+  const _ValT&
+  at(const _KeyT& k) const {
+    auto it = find(k);
+    if (it == end()) {
+      throw std::out_of_range("flat_map::at");
+    }
+    return it->second;
+  }
+
+  _ValT&
+  operator[](const _KeyT& k) {
+    auto it = std::lower_bound(_v.begin(), _v.end(), k,
+                               [](const value_type& a, const _KeyT& b) { return a.first < b; });
+    if (it == _v.end() || k < it->first) {
+      it = _v.insert(it, value_type(k, _ValT()));
+    }
+    return it->second;
+  }
+
+  /// \brief Builds the map from unsorted pairs, for duplicated keys the
+  /// last pair wins.
+  void
+  assign_unsorted(std::vector<value_type>&& pairs) {
+    _v = std::move(pairs);
+    std::stable_sort(_v.begin(), _v.end(),
+                     [](const value_type& a, const value_type& b) { return a.first < b.first; });
+    // keep the last of each run of equal keys
+    size_t w = 0;
+    for (size_t i = 0; i < _v.size(); ++i) {
+      if (i + 1 < _v.size() && !(_v[i].first < _v[i + 1].first)) {
+        continue;
+      }
+      if (w != i) {
+        _v[w] = std::move(_v[i]);
+      }
+      ++w;
+    }
+    _v.resize(w);
+  }
+
+private:
+  std::vector<value_type> _v;
+
+  const_iterator
+  lower(const _KeyT& k) const {
+    return std::lower_bound(_v.begin(), _v.end(), k,
+                            [](const value_type& a, const _KeyT& b) { return a.first < b; });
+  }
+};
+
+template <typename _T>
+struct is_flat_map : std::false_type { };
+
+template <typename _KeyT, typename _ValT>
+struct is_flat_map<flat_map<_KeyT, _ValT>> : std::true_type { };
+
+// Splits a line as 'Key [sep] Val', other occurrences of [sep] are part
+// of Val and everything from the comment char on is ignored.
+inline bool
+tokenize_line(std::string_view line, char delimiter, char comment,
+              std::string_view& key, std::string_view& val) {
+  size_t end = line.find(comment);
+  if (end != std::string_view::npos) {
+    line = line.substr(0, end);
+  }
+  size_t sep = line.find(delimiter);
+  if (sep == std::string_view::npos) {
+    return false;
+  }
+  key = line.substr(0, sep);
+  val = line.substr(sep + 1);
+  if (!val.empty() && val.back() == '\r') {
+    val.remove_suffix(1);
+  }
+  return true;
+}
+
+// Parses the lines in [b, e) appending the pairs to out.
+template <typename _KeyT, typename _ValT>
+void
+parse_pairs(const char* b, const char* e, char delimiter, char comment,
+            std::vector<std::pair<_KeyT, _ValT>>& out) {
+  while (b < e) {
+    const char* nl = static_cast<const char*>(std::memchr(b, '\n', e - b));
+    const char* le = nl ? nl : e;
+    std::string_view key, val;
+    if (tokenize_line(std::string_view(b, le - b), delimiter, comment, key, val)) {
+      out.emplace_back(from_string<_KeyT>(key), from_string<_ValT>(val));
+    }
+    b = nl ? nl + 1 : e;
+  }
+}
+
+template <typename _MapT, typename _KeyT, typename _ValT>
+void
+pairs_to_map(std::vector<std::pair<_KeyT, _ValT>>&& pairs, _MapT& map) {
+  if constexpr (is_flat_map<_MapT>::value) {
+    map.assign_unsorted(std::move(pairs));
+  } else {
+    for (auto& p : pairs) {
+      map[std::move(p.first)] = std::move(p.second);
+    }
+  }
 }
 
 // Tokenization: assumes 'Key [sep] Val' other occurrences of [sep]
 // are considered part of Val
-template <typename _KeyT, typename _ValT>
-std::map<_KeyT,_ValT>
+template <typename _KeyT, typename _ValT, typename _MapT = std::map<_KeyT, _ValT>>
+_MapT
 stream_to_map(std::istream& _is, char delimiter='=', char comment='#') {
-  std::map<_KeyT, _ValT> _map;
-  while(!_is.eof()) {
-    std::string line {};
-    std::getline(_is, line);
-    // strip comment setting end to the first occurence of the comment char
-    auto end = std::find(line.begin(), line.end(), comment);
-    auto _sep_iter = std::find(line.begin(), end, delimiter);
-    if (_sep_iter != end) {
-      _KeyT _key = from_string<_KeyT>(std::string {line.begin(), _sep_iter});
-      _ValT _val = from_string<_ValT>(std::string { ++_sep_iter, end});
-      _map[_key] = _val;
+  _MapT _map;
+  std::string line {};
+  std::vector<std::pair<_KeyT, _ValT>> pairs;
+  while(std::getline(_is, line)) {
+    std::string_view key, val;
+    if (tokenize_line(line, delimiter, comment, key, val)) {
+      if constexpr (is_flat_map<_MapT>::value) {
+        pairs.emplace_back(from_string<_KeyT>(key), from_string<_ValT>(val));
+      } else {
+        _map[from_string<_KeyT>(key)] = from_string<_ValT>(val);
+      }
     }
   }
+  if constexpr (is_flat_map<_MapT>::value) {
+    pairs_to_map(std::move(pairs), _map);
+  }
   return _map;
 }
 
+/// \brief Parses the key value lines of [data, data + size) in place
+/// (no line copies). With a pool the buffer is split at line boundaries
+/// in chunks parsed concurrently; the result is the same as a
+/// sequential parse (for duplicated keys the last line wins).
+template <typename _KeyT, typename _ValT, typename _MapT = std::map<_KeyT, _ValT>>
+_MapT
+buffer_to_map(const char* data, size_t size, char delimiter = '=', char comment = '#',
+              thread_pool* pool = nullptr, size_t chunk_size = size_t(1) << 22) {
+  typedef std::vector<std::pair<_KeyT, _ValT>> pair_vector;
+  _MapT map;
+  if (!pool || size <= chunk_size) {
+    pair_vector pairs;
+    parse_pairs(data, data + size, delimiter, comment, pairs);
+    pairs_to_map(std::move(pairs), map);
+    return map;
+  }
+  std::vector<size_t> bounds { 0 };
+  for (size_t p = chunk_size; p < size; p += chunk_size) {
+    const char* nl = static_cast<const char*>(std::memchr(data + p, '\n', size - p));
+    if (!nl) {
+      break;
+    }
+    size_t b = (nl - data) + 1;
+    if (b > bounds.back() && b < size) {
+      bounds.push_back(b);
+    }
+    p = std::max(p, b);
+  }
+  bounds.push_back(size);
+  std::vector<pair_vector> parts(bounds.size() - 1);
+  // waits for every chunk before rethrowing a parse error
+  parallel_for(*pool, parts.size(), [&](size_t i) {
+    parse_pairs(data + bounds[i], data + bounds[i + 1], delimiter, comment, parts[i]);
+  });
+  pair_vector all;
+  if constexpr (is_flat_map<_MapT>::value) {
+    size_t n = 0;
+    for (auto& p : parts) { n += p.size(); }
+    all.reserve(n);
+  }
+  for (auto& p : parts) {
+    if constexpr (is_flat_map<_MapT>::value) {
+      std::move(p.begin(), p.end(), std::back_inserter(all));
+    } else {
+      pairs_to_map(std::move(p), map);
+    }
+  }
+  if constexpr (is_flat_map<_MapT>::value) {
+    pairs_to_map(std::move(all), map);
+  }
+  return map;
+}
+
+/// \brief Memory maps the file at path and parses it with buffer_to_map.
+template <typename _KeyT, typename _ValT, typename _MapT = std::map<_KeyT, _ValT>>
+_MapT
+mapped_file_to_map(const std::string& path, char delimiter = '=', char comment = '#',
+                   thread_pool* pool = nullptr) {
+  mapped_file f(path, true);
+  return buffer_to_map<_KeyT, _ValT, _MapT>(f.data(), f.size(), delimiter, comment, pool);
+}
+
 using StringStringMap = typename std::map<std::string, std::string>;
+using StringStringHashMap = typename std::unordered_map<std::string, std::string>;
+using StringStringFlatMap = flat_map<std::string, std::string>;
 
 /// \brief Creates a map from string to string starting from the file
 /// at the given path.
@@ -16,6 +16,7 @@
 
 #include "../ctl.h"
 
+#include <cstddef>
 #include <iterator>
 
 #ifndef _CTL_CIRCULAR_ITERATOR_H_
@@ -23,44 +24,155 @@
 
 CTL_DEFAULT_NAMESPACE_BEGIN
 
+/// \brief Random access iterator that walks the \c n elements starting
+/// at \c b forever, wrapping around at the end. Besides the position
+/// inside the range the iterator counts the laps it has done, so that
+/// iterators can be compared and subtracted as if the range was
+/// unrolled (e.g., \c it + n is one lap ahead of \c it and not equal to
+/// it). Increment and decrement only branch on the wrap-around, the
+/// modulo is used only for jumps longer than the range.
 template <typename _IterT, typename IntType>
 class circular_iterator
-  : public std::iterator<std::random_access_iterator_tag,
-			 typename std::iterator_traits<_IterT>::value_type,
-			 typename std::iterator_traits<_IterT>::difference_type,
-			 typename std::iterator_traits<_IterT>::pointer,
-			 typename std::iterator_traits<_IterT>::reference>
 {
+public:
+  typedef std::random_access_iterator_tag iterator_category;
+  typedef typename std::iterator_traits<_IterT>::value_type value_type;
+  typedef typename std::iterator_traits<_IterT>::difference_type difference_type;
+  typedef typename std::iterator_traits<_IterT>::pointer pointer;
+  typedef typename std::iterator_traits<_IterT>::reference reference;
+
 private:
   _IterT  _b;
   IntType _n;
   IntType _curr;
+  difference_type _lap;
+
+  // moves by k (any sign), n must be positive
+  void
+  advance(difference_type k)
+  {
+    const difference_type n = static_cast<difference_type>(_n);
+    difference_type c = static_cast<difference_type>(_curr) + k;
+    if (c >= 0 && c < n) {
+      _curr = static_cast<IntType>(c);
+      return;
+    }
+    if (c >= n && c < 2 * n) {
+      _curr = static_cast<IntType>(c - n);
+      ++_lap;
+      return;
+    }
+    if (c < 0 && c >= -n) {
+      _curr = static_cast<IntType>(c + n);
+      --_lap;
+      return;
+    }
+    difference_type q = c / n;
+    difference_type r = c % n;
+    if (r < 0) {
+      r += n;
+      --q;
+    }
+    _curr = static_cast<IntType>(r);
+    _lap += q;
+  }
+
 public:
-  circular_iterator(_IterT b, IntType n)
-    : _b { b }, _n { n }, _curr { 0 } {}
+  circular_iterator()
+    : _b {}, _n { 0 }, _curr { 0 }, _lap { 0 } {}
 
-  circular_iterator operator+(IntType k)
+  circular_iterator(_IterT b, IntType n, IntType start = 0)
+    : _b { b }, _n { n }, _curr { 0 }, _lap { 0 }
   {
-    circular_iterator tmp(_b, _n);
-    tmp._curr += (_curr + k) % _n;
-    return tmp;
+    if (start != 0) {
+      advance(static_cast<difference_type>(start));
+    }
   }
 
-  circular_iterator operator++()
-    { _curr = (_curr + 1) % _n; return *this; }
+  /// \brief Position inside the range, in <tt>[0, n)</tt>
+  IntType position() const { return _curr; }
+  /// \brief Number of complete laps (negative when moved backwards)
+  difference_type lap() const { return _lap; }
+  /// \brief Length of the range
+  IntType period() const { return _n; }
+  /// \brief Iterator to the current element of the underlying range
+  _IterT base() const { return _b + _curr; }
 
-  typename std::iterator_traits<_IterT>::value_type& operator*()
-    { return *(_b + _curr); }
+  reference operator*() const { return *(_b + _curr); }
+  pointer operator->() const { return &*(_b + _curr); }
+  reference operator[](difference_type k) const { return *(*this + k); }
+
+  circular_iterator& operator++()
+  {
+    if (++_curr == _n) {
+      _curr = 0;
+      ++_lap;
+    }
+    return *this;
+  }
+
+  circular_iterator operator++(int)
+    { circular_iterator tmp(*this); ++*this; return tmp; }
+
+  circular_iterator& operator--()
+  {
+    if (_curr == 0) {
+      _curr = _n;
+      --_lap;
+    }
+    --_curr;
+    return *this;
+  }
+
+  circular_iterator operator--(int)
+    { circular_iterator tmp(*this); --*this; return tmp; }
+
+  circular_iterator& operator+=(difference_type k) { advance(k); return *this; }
+  circular_iterator& operator-=(difference_type k) { advance(-k); return *this; }
+
+  circular_iterator operator+(difference_type k) const
+    { circular_iterator tmp(*this); tmp.advance(k); return tmp; }
+  circular_iterator operator-(difference_type k) const
+    { circular_iterator tmp(*this); tmp.advance(-k); return tmp; }
+  friend circular_iterator operator+(difference_type k, const circular_iterator& it)
+    { return it + k; }
+
+  /// \brief Distance in the unrolled sequence, both iterators must
+  /// walk the same range
+  difference_type operator-(const circular_iterator& o) const
+  {
+    return (_lap - o._lap) * static_cast<difference_type>(_n)
+      + (static_cast<difference_type>(_curr) - static_cast<difference_type>(o._curr));
+  }
+
+  bool operator==(const circular_iterator& o) const
+    { return _curr == o._curr && _lap == o._lap; }
+  bool operator!=(const circular_iterator& o) const { return !(*this == o); }
+  bool operator<(const circular_iterator& o) const
+    { return _lap < o._lap || (_lap == o._lap && _curr < o._curr); }
+  bool operator>(const circular_iterator& o) const { return o < *this; }
+  bool operator<=(const circular_iterator& o) const { return !(o < *this); }
+  bool operator>=(const circular_iterator& o) const { return !(*this < o); }
 };
 
-template <typename _IterT, typename IntType>
+template <typename _IterT, typename IntType,
+          typename = typename std::iterator_traits<_IterT>::iterator_category>
 circular_iterator<_IterT, IntType>
 make_circular_iterator(_IterT it, IntType n)
 {
   return circular_iterator<_IterT, IntType>(it, n);
 }
 
-// TODO: Implement make_* for container
+/// \brief Circular iterator over a whole container (which must have
+/// random access iterators) starting at element \c start
+template <typename _ContT>
+auto
+make_circular_iterator(_ContT& c, size_t start = 0)
+  -> circular_iterator<decltype(std::begin(c)), size_t>
+{
+  return circular_iterator<decltype(std::begin(c)), size_t>(
+    std::begin(c), static_cast<size_t>(std::size(c)), start);
+}
 
 CTL_DEFAULT_NAMESPACE_END
 
@@ -17,6 +17,8 @@
 #include "../ctl.h"
 
 #include <cstdint>
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -26,49 +28,158 @@
 
 CTL_DEFAULT_NAMESPACE_BEGIN
 
+/// \brief Enumerates the words of Sigma^n, either in lexicographic
+/// order or in (reflected, mixed radix) Gray code order where each step
+/// changes exactly one position. The current word is kept in place and
+/// only the positions changed by a step are rewritten. Words have a
+/// rank (their position in the enumeration) and seek() moves to any
+/// rank in O(n), so that Sigma^n can be split in independent ranges
+/// (ranks are 64 bit, hence |Sigma|^n must be below 2^64):
+///
+///   SigmaNIterator it(n, S), last(n, S);
+///   it.seek(b); last.seek(e);
+///   for (; it != last; ++it) { ... }
 class SigmaNIterator {
 private:
   std::vector<uint8_t> x;
   std::string alphabet;
   bool end;
-  
+  std::string w;
+  bool gray;
+  std::vector<int8_t> dir;
+  std::vector<uint64_t> pw;
+  uint64_t r;
+  uint64_t c;
+  size_t ch;
+
+  void
+  set_digit(size_t j, uint8_t d) {
+    c = c - x[j] * pw[j] + d * pw[j];
+    x[j] = d;
+    w[j] = alphabet[d];
+  }
+
 public:
-  SigmaNIterator(size_t n, std::string Sigma) :
-    x(n, 0), alphabet {Sigma}, end {false}
-    { }
+  SigmaNIterator(size_t n, std::string Sigma, bool gray_order = false) :
+    x(n, 0), alphabet {Sigma}, end {false}, w(n, Sigma.empty() ? '\0' : Sigma[0]),
+    gray {gray_order}, dir(n, 1), pw(n, 1), r {0}, c {0}, ch {0}
+    {
+      const uint64_t sigma = alphabet.size();
+      const uint64_t max = std::numeric_limits<uint64_t>::max();
+      for (size_t j = n; j-- > 0; ) {
+        // pw[j] * sigma is pw[j-1], or size() for j == 0
+        if (sigma > 1 && pw[j] > max / sigma) {
+          throw std::invalid_argument("SigmaNIterator: |Sigma|^n does not fit 64 bits");
+        }
+        if (j > 0) {
+          pw[j-1] = pw[j] * sigma;
+        }
+      }
+      end = alphabet.empty();
+    }
 
-  SigmaNIterator() : end {true} { }
+  SigmaNIterator() : end {true}, gray {false}, r {0}, c {0}, ch {0} { }
 
   SigmaNIterator& operator++() {
-    if (!end) {
-      int j = x.size()-1;
+    if (end) {
+      return *this;
+    }
+    int j = x.size()-1;
+    if (!gray) {
       while(j>=0 and x[j] == (alphabet.size()-1)) {
-	x[j] = 0;
+	set_digit(j, 0);
 	j--;
       }
       if (j>=0) {
-	x[j]++;
+	set_digit(j, x[j] + 1);
       }
       else {
-	end = true;	
+	end = true;
       }
     }
+    else {
+      // the lowest digit that can move in its direction moves, the
+      // blocked ones below it reverse direction
+      while (j>=0 and ((dir[j] > 0 and x[j] == alphabet.size()-1)
+                       or (dir[j] < 0 and x[j] == 0))) {
+        dir[j] = -dir[j];
+        j--;
+      }
+      if (j>=0) {
+        set_digit(j, x[j] + dir[j]);
+      }
+      else {
+        end = true;
+      }
+    }
+    ch = (j >= 0) ? static_cast<size_t>(j) : 0;
+    ++r;
     return *this;
   }
 
-  std::string operator*() {
-    std::string s {""};
-    for (auto it = x.begin(); it != x.end(); ++it) {
-      s += alphabet[*it];
+  /// \brief Current word, valid until the next step.
+  const std::string& operator*() const {
+    return w;
+  }
+
+  const std::string& word() const { return w; }
+
+  /// \brief Current word as alphabet indices.
+  const std::vector<uint8_t>& digits() const { return x; }
+
+  /// \brief Current word as integer (base |Sigma|, first symbol most
+  /// significant); equals rank() in lexicographic order.
+  uint64_t code() const { return c; }
+
+  /// \brief Position of the current word in the enumeration.
+  uint64_t rank() const { return r; }
+
+  /// \brief Leftmost position changed by the last step, positions
+  /// before it are unchanged (in Gray order it is the only change).
+  size_t changed() const { return ch; }
+
+  /// \brief Number of words, |Sigma|^n (below 2^64, checked by the
+  /// constructor).
+  uint64_t size() const { return x.empty() ? 1 : pw[0] * alphabet.size(); }
+
+  bool is_gray() const { return gray; }
+
+  /// \brief Moves to the word of the given rank in O(n); rank size()
+  /// is the end position.
+  SigmaNIterator&
+  seek(uint64_t rank) {
+    const uint64_t sigma = alphabet.size();
+    r = rank;
+    ch = 0;
+    if (rank >= size()) {
+      end = true;
+      r = size();
+      return *this;
+    }
+    end = false;
+    // parity of the number formed by the digits before position j
+    bool odd_prefix = false;
+    for (size_t j = 0; j < x.size(); ++j) {
+      uint8_t b = static_cast<uint8_t>((rank / pw[j]) % sigma);
+      uint8_t d = b;
+      if (gray) {
+        dir[j] = odd_prefix ? -1 : 1;
+        d = odd_prefix ? static_cast<uint8_t>(sigma - 1 - b) : b;
+        odd_prefix = (sigma % 2 == 1) ? (odd_prefix != (b % 2 == 1)) : (b % 2 == 1);
+      }
+      set_digit(j, d);
     }
-    return s;
+    return *this;
   }
 
-  bool operator==(const SigmaNIterator& other) {
-    return (end == other.end);
+  bool operator==(const SigmaNIterator& other) const {
+    if (end or other.end) {
+      return end == other.end;
+    }
+    return r == other.r;
   }
 
-  bool operator!=(const SigmaNIterator& other) {
+  bool operator!=(const SigmaNIterator& other) const {
     return !(*this == other);
   }
   
@@ -0,0 +1,183 @@
+// rand/philox.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file philox.hpp \brief Counter based random number generation
+/// (Philox4x32-10, Salmon et al. SC'11) and helpers to fill buffers in
+/// parallel with output independent of the number of threads.
+
+#include "../ctl.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifndef _CTL_RAND_PHILOX_
+#define _CTL_RAND_PHILOX_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+/// \brief Philox4x32-10 counter based generator.
+///
+/// The state is a (key, counter) pair: the key is derived from the seed,
+/// the 128 bit counter is split in a 64 bit \e stream and a 64 bit
+/// \e position. Every counter value yields four 32 bit words which are
+/// returned as two 64 bit outputs, hence discard() and seek() are O(1).
+/// Satisfies the UniformRandomBitGenerator requirements.
+class philox4x32
+{
+public:
+  typedef uint64_t result_type;
+
+  explicit philox4x32(uint64_t seed = 0, uint64_t stream = 0)
+    : _key { static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32) },
+      _stream {stream}, _block {0}, _idx {2}
+  { }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+  result_type
+  operator()() {
+    if (_idx == 2) {
+      generate_block(_block++, _out);
+      _idx = 0;
+    }
+    return _out[_idx++];
+  }
+
+  /// \brief Skips the next n outputs in O(1).
+  void
+  discard(uint64_t n) {
+    seek(position() + n);
+  }
+
+  /// \brief Moves to the n-th 64 bit output of the current stream.
+  void
+  seek(uint64_t n) {
+    _block = n / 2;
+    _idx = 2;
+    if (n % 2) {
+      generate_block(_block++, _out);
+      _idx = 1;
+    }
+  }
+
+  /// \brief Index of the next 64 bit output within the current stream.
+  uint64_t
+  position() const {
+    return (_idx == 2) ? _block * 2 : (_block - 1) * 2 + _idx;
+  }
+
+  /// \brief Switches to the beginning of another independent stream.
+  void
+  set_stream(uint64_t stream) {
+    _stream = stream;
+    _block = 0;
+    _idx = 2;
+  }
+
+  uint64_t stream() const { return _stream; }
+
+  /// \brief Stateless evaluation of the block function.
+  void
+  generate_block(uint64_t block, result_type* out) const {
+    uint32_t c[4] = { static_cast<uint32_t>(block), static_cast<uint32_t>(block >> 32),
+                      static_cast<uint32_t>(_stream), static_cast<uint32_t>(_stream >> 32) };
+    uint32_t k[2] = { _key[0], _key[1] };
+    for (int r = 0; r < 10; ++r) {
+      uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * c[0];
+      uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * c[2];
+      uint32_t hi0 = static_cast<uint32_t>(p0 >> 32), lo0 = static_cast<uint32_t>(p0);
+      uint32_t hi1 = static_cast<uint32_t>(p1 >> 32), lo1 = static_cast<uint32_t>(p1);
+      c[0] = hi1 ^ c[1] ^ k[0];
+      c[1] = lo1;
+      c[2] = hi0 ^ c[3] ^ k[1];
+      c[3] = lo0;
+      k[0] += 0x9E3779B9u;
+      k[1] += 0xBB67AE85u;
+    }
+    out[0] = (static_cast<uint64_t>(c[1]) << 32) | c[0];
+    out[1] = (static_cast<uint64_t>(c[3]) << 32) | c[2];
+  }
+
+  bool
+  operator==(const philox4x32& o) const {
+    return _key[0] == o._key[0] && _key[1] == o._key[1] && _stream == o._stream
+      && position() == o.position();
+  }
+
+  bool operator!=(const philox4x32& o) const { return !(*this == o); }
+
+private:
+  uint32_t _key[2];
+  uint64_t _stream;
+  uint64_t _block;
+  unsigned _idx;
+  result_type _out[2];
+};
+
+inline philox4x32
+make_philox(uint64_t seed, uint64_t stream = 0) {
+  return philox4x32(seed, stream);
+}
+
+/// \brief Fills out[0..n) in blocks of block_size elements, block b is
+/// produced by gen(out + b * block_size, len, rng) where rng is a
+/// philox4x32 seeded with seed on stream b. Blocks are handed out to
+/// n_threads workers (0 means hardware concurrency) but the result only
+/// depends on seed and block_size, which must be positive.
+template <typename _OutT, typename _GenF>
+void
+parallel_generate(_OutT* out, size_t n, uint64_t seed, _GenF gen,
+                  size_t n_threads = 0, size_t block_size = size_t(1) << 16) {
+  if (block_size == 0) {
+    throw std::invalid_argument("parallel_generate: block_size must be positive");
+  }
+  if (n_threads == 0) {
+    n_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+  }
+  const size_t n_blocks = (n + block_size - 1) / block_size;
+  n_threads = std::min(n_threads, std::max<size_t>(1, n_blocks));
+  std::atomic<size_t> next {0};
+  auto worker = [&]() {
+    // copy of the functor so that stateful generators are not shared
+    _GenF g = gen;
+    for (size_t b = next++; b < n_blocks; b = next++) {
+      philox4x32 rng(seed, b);
+      size_t first = b * block_size;
+      g(out + first, std::min(block_size, n - first), rng);
+    }
+  };
+  if (n_threads == 1) {
+    worker();
+    return;
+  }
+  std::vector<std::thread> pool;
+  for (size_t t = 0; t < n_threads; ++t) {
+    pool.emplace_back(worker);
+  }
+  for (auto& th : pool) {
+    th.join();
+  }
+}
+
+CTL_DEFAULT_NAMESPACE_END
+
+#endif
@@ -17,14 +17,204 @@
 
 #include "../ctl.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstdint>
+#include <limits>
 #include <random>
+#include <vector>
 
 #ifndef _CTL_RANDOM_SEQUENCE_
 #define _CTL_RANDOM_SEQUENCE_
 
 CTL_DEFAULT_NAMESPACE_BEGIN
 
+// Draws a full 64 bit word from any uniform random bit generator. Engines
+// with a 64 or 32 bit range (e.g., std::mt19937_64, std::mt19937) are
+// consumed directly, other engines go through uniform_int_distribution.
+template<typename _RandD>
+inline uint64_t
+random_word64(_RandD& dev) {
+  constexpr uint64_t range =
+    static_cast<uint64_t>(_RandD::max() - _RandD::min());
+  if constexpr (range == std::numeric_limits<uint64_t>::max()) {
+    return static_cast<uint64_t>(dev() - _RandD::min());
+  } else if constexpr (range == std::numeric_limits<uint32_t>::max()) {
+    uint64_t hi = static_cast<uint64_t>(dev() - _RandD::min());
+    uint64_t lo = static_cast<uint64_t>(dev() - _RandD::min());
+    return (hi << 32) | lo;
+  } else {
+    std::uniform_int_distribution<uint64_t> ud;
+    return ud(dev);
+  }
+}
+
+/// \brief Vose's construction of an alias table over cols columns.
+/// p[i] is the weight of column i scaled so that the weights sum to
+/// cols (p is overwritten), full is the fixed point value of
+/// probability one. work must hold cols entries.
+template<typename _ThrT, typename _IdxT>
+void
+build_alias_columns(double* p, size_t cols, uint64_t full,
+                    _ThrT* threshold, _IdxT* alias, size_t* work) {
+  // small stack grows from the front of work, large from the back
+  size_t ns = 0, nl = 0;
+  for (size_t i = 0; i < cols; ++i) {
+    if (p[i] < 1.0) { work[ns++] = i; } else { work[cols - 1 - nl++] = i; }
+  }
+  while (ns > 0 && nl > 0) {
+    size_t s = work[--ns];
+    size_t l = work[cols - nl];
+    threshold[s] = static_cast<_ThrT>(p[s] * static_cast<double>(full));
+    alias[s] = static_cast<_IdxT>(l);
+    p[l] = (p[l] + p[s]) - 1.0;
+    if (p[l] < 1.0) {
+      --nl;
+      work[ns++] = l;
+    }
+  }
+  // leftovers are (up to rounding) full columns
+  for (size_t i = 0; i < ns; ++i) {
+    threshold[work[i]] = static_cast<_ThrT>(full);
+    alias[work[i]] = static_cast<_IdxT>(work[i]);
+  }
+  for (size_t i = 0; i < nl; ++i) {
+    threshold[work[cols - 1 - i]] = static_cast<_ThrT>(full);
+    alias[work[cols - 1 - i]] = static_cast<_IdxT>(work[cols - 1 - i]);
+  }
+}
+
+/// \brief Walker's alias table (Vose construction) for sampling an
+/// index in [0, k) with O(1) work per draw.
+///
+/// The table is padded to 2^b columns so that a column is selected by
+/// masking the low b bits of a random lane, the remaining bits of the
+/// lane are used as a fixed point coin compared against the column
+/// threshold. With b <= 16 a lane is 32 bits wide and a single 64 bit
+/// random word yields two samples.
+template<typename _IndexT = uint32_t>
+class alias_table
+{
+public:
+  typedef _IndexT index_type;
+
+  alias_table() : _k {0}, _bits {0}, _lane_bits {32} { }
+
+  template<typename _IterT>
+  alias_table(_IterT wbegin, _IterT wend) {
+    std::vector<double> w;
+    for (; wbegin != wend; ++wbegin) {
+      w.push_back(static_cast<double>(*wbegin));
+    }
+    build(w);
+  }
+
+  size_t size() const { return _k; }
+  unsigned bits() const { return _bits; }
+  unsigned lane_bits() const { return _lane_bits; }
+  unsigned lanes_per_word() const { return 64 / _lane_bits; }
+
+  /// \brief Maps a random lane (only the low lane_bits() bits are used)
+  /// to an index.
+  index_type
+  sample_lane(uint64_t lane) const {
+    uint64_t col = lane & _mask;
+    uint64_t coin = (lane >> _bits) & _coin_mask;
+    return (coin < _threshold[col]) ? static_cast<index_type>(col) : _alias[col];
+  }
+
+  template<typename _RandD>
+  index_type
+  operator()(_RandD& dev) const {
+    return sample_lane(random_word64(dev));
+  }
+
+  /// \brief Fills out[0..n) with indices, consuming lanes_per_word()
+  /// samples from every random word.
+  template<typename _OutT, typename _RandD>
+  void
+  fill(_OutT* out, size_t n, _RandD& dev) const {
+    const unsigned lanes = lanes_per_word();
+    size_t i = 0;
+    if (lanes == 2) {
+      for (; i + 2 <= n; i += 2) {
+        uint64_t w = random_word64(dev);
+        out[i]   = static_cast<_OutT>(sample_lane(w));
+        out[i+1] = static_cast<_OutT>(sample_lane(w >> 32));
+      }
+    }
+    for (; i < n; ++i) {
+      out[i] = static_cast<_OutT>(sample_lane(random_word64(dev)));
+    }
+  }
+
+  /// \brief Converts random words into lanes_per_word() samples each;
+  /// the loop is branch free so that it can be vectorized.
+  template<typename _OutT>
+  void
+  convert(const uint64_t* words, size_t nwords, _OutT* out) const {
+    const unsigned lanes = lanes_per_word();
+    const uint64_t* thr = _threshold.data();
+    const index_type* al = _alias.data();
+    for (size_t i = 0; i < nwords; ++i) {
+      for (unsigned l = 0; l < lanes; ++l) {
+        uint64_t lane = words[i] >> (l * _lane_bits);
+        uint64_t col = lane & _mask;
+        uint64_t coin = (lane >> _bits) & _coin_mask;
+        out[i * lanes + l] =
+          static_cast<_OutT>((coin < thr[col]) ? static_cast<index_type>(col) : al[col]);
+      }
+    }
+  }
+
+  /// \brief True if every column is selected with the same probability.
+  bool
+  is_uniform() const {
+    if (_k != (size_t(1) << _bits)) {
+      return false;
+    }
+    for (size_t i = 0; i < _k; ++i) {
+      if (_threshold[i] != _coin_mask + 1 || _alias[i] != i) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  size_t _k;
+  unsigned _bits;
+  unsigned _lane_bits;
+  uint64_t _mask;
+  uint64_t _coin_mask;
+  std::vector<uint64_t> _threshold;
+  std::vector<index_type> _alias;
+
+  void
+  build(const std::vector<double>& w) {
+    _k = w.size();
+    _bits = 0;
+    while ((size_t(1) << _bits) < _k) { ++_bits; }
+    _lane_bits = (_bits <= 16) ? 32 : 64;
+    const unsigned coin_bits = std::min(32u, _lane_bits - _bits);
+    const size_t cols = size_t(1) << _bits;
+    _mask = cols - 1;
+    _coin_mask = (coin_bits >= 64) ? ~uint64_t(0) : ((uint64_t(1) << coin_bits) - 1);
+
+    double total = 0;
+    for (double x : w) { total += x; }
+    std::vector<double> p(cols, 0.0);
+    for (size_t i = 0; i < _k; ++i) {
+      p[i] = (total > 0) ? w[i] * cols / total : (cols / static_cast<double>(_k));
+    }
+    _threshold.assign(cols, 0);
+    _alias.assign(cols, 0);
+    std::vector<size_t> work(cols);
+    build_alias_columns(p.data(), cols, _coin_mask + 1,
+                        _threshold.data(), _alias.data(), work.data());
+  }
+};
+
 template<typename _SampleT>
 class sequence_distribution
 {
@@ -37,46 +227,72 @@ public:
     : omega(begin,end)
   {
     std::vector<int> v(omega.size(), 1);
-    dd = std::discrete_distribution<int>(v.begin(), v.end());
+    at = alias_table<uint32_t>(v.begin(), v.end());
   }
 
-  // TODO Constructor with distribution
   template<typename _IterT, typename _DistT>
   sequence_distribution(const _IterT& begin, const _IterT& end,
 			const _DistT& dbegin, const _DistT& dend)
-    : omega(begin, end), dd(dbegin, dend)
+    : omega(begin, end), at(dbegin, dend)
   {
   }
-    
+
+  const std::vector<sample_type>& symbols() const { return omega; }
+  const alias_table<uint32_t>& table() const { return at; }
+
   // generate operations
   template<typename _RandD>
   sample_type
   operator()(_RandD& dev)
-  { return omega[dd(dev)]; }
-  
+  { return omega[at(dev)]; }
+
+  /// \brief Bulk generation into the contiguous buffer out[0..n).
+  template<typename _RandD>
+  void
+  operator()(sample_type* out, size_t n, _RandD& dev)
+  {
+    constexpr size_t chunk = 4096;
+    uint32_t idx[chunk];
+    while (n > 0) {
+      size_t c = std::min(n, chunk);
+      at.fill(idx, c, dev);
+      for (size_t i = 0; i < c; ++i) {
+        out[i] = omega[idx[i]];
+      }
+      out += c;
+      n -= c;
+    }
+  }
+
   template<typename _InsIt, typename _RandD>
   void
   operator()(size_t n, _InsIt it, _RandD& dev)
   {
+    constexpr size_t chunk = 4096;
+    sample_type buf[chunk];
     while(n>0) {
-      *it = omega[dd(dev)];
-      ++it;
-      n--;
+      size_t c = std::min(n, chunk);
+      (*this)(buf, c, dev);
+      it = std::copy(buf, buf + c, it);
+      n -= c;
     }
   }
 
-  
-// TODO
-
-// Convenience function to produce sequence directly
-// _ContT sequence(size_t n)
-  
+  /// \brief Convenience function to produce a sequence directly.
+  template<typename _ContT, typename _RandD>
+  _ContT
+  sequence(size_t n, _RandD& dev)
+  {
+    _ContT c(n, sample_type());
+    if (n > 0) {
+      (*this)(&c[0], n, dev);
+    }
+    return c;
+  }
 
 private:
   std::vector<sample_type> omega;
-  std::discrete_distribution<int> dd;
-
-  
+  alias_table<uint32_t> at;
 };
 
 // factory functions
@@ -0,0 +1,288 @@
+// str/batch_distance.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file batch_distance.hpp \brief Edit distance of many independent
+/// pairs at once, one pair per SIMD lane.
+///
+/// Up to lanes() pairs are transposed so that position i of every pair
+/// sits in the same vector, then the EditDistanceWF recurrence is run
+/// on 16 bit lanes over the longest pair. Pairs of different lengths
+/// need no special treatment inside the recurrence: cell (i, j) only
+/// depends on cells above and to the left, so the score of a pair is
+/// read at (n, m) before padding can reach it. The lane type is chosen
+/// at compile time: AVX-512BW (32 lanes), AVX2 (16 lanes) or a portable
+/// array of 16 lanes. Pairs whose score could overflow 16 bits are
+/// computed with the scalar recurrence.
+
+#include "../ctl.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512BW__)
+#include <immintrin.h>
+#endif
+
+#ifndef _CTL_STR_BATCH_DISTANCE_
+#define _CTL_STR_BATCH_DISTANCE_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+/// \brief Portable lanes, plain loops the compiler may vectorize
+struct batch_lanes_portable
+{
+  static constexpr size_t width = 16;
+  struct vec { uint16_t x[width]; };
+
+  static vec
+  load(const uint16_t* p) {
+    vec v;
+    std::copy(p, p + width, v.x);
+    return v;
+  }
+  static void store(uint16_t* p, const vec& v) { std::copy(v.x, v.x + width, p); }
+  static vec
+  set1(uint16_t c) {
+    vec v;
+    std::fill(v.x, v.x + width, c);
+    return v;
+  }
+  static vec
+  adds(const vec& a, const vec& b) {
+    vec v;
+    for (size_t k = 0; k < width; ++k) {
+      uint32_t s = uint32_t(a.x[k]) + b.x[k];
+      v.x[k] = static_cast<uint16_t>(s > 0xffff ? 0xffff : s);
+    }
+    return v;
+  }
+  static vec
+  min(const vec& a, const vec& b) {
+    vec v;
+    for (size_t k = 0; k < width; ++k) {
+      v.x[k] = std::min(a.x[k], b.x[k]);
+    }
+    return v;
+  }
+  // c where a != b, 0 elsewhere
+  static vec
+  mismatch(const vec& a, const vec& b, const vec& c) {
+    vec v;
+    for (size_t k = 0; k < width; ++k) {
+      v.x[k] = (a.x[k] == b.x[k]) ? 0 : c.x[k];
+    }
+    return v;
+  }
+};
+
+#if defined(__AVX2__)
+struct batch_lanes_avx2
+{
+  static constexpr size_t width = 16;
+  typedef __m256i vec;
+
+  static vec load(const uint16_t* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+  static void store(uint16_t* p, vec v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+  static vec set1(uint16_t c) { return _mm256_set1_epi16(static_cast<short>(c)); }
+  static vec adds(vec a, vec b) { return _mm256_adds_epu16(a, b); }
+  static vec min(vec a, vec b) { return _mm256_min_epu16(a, b); }
+  static vec mismatch(vec a, vec b, vec c) { return _mm256_andnot_si256(_mm256_cmpeq_epi16(a, b), c); }
+};
+#endif
+
+#if defined(__AVX512BW__)
+struct batch_lanes_avx512
+{
+  static constexpr size_t width = 32;
+  typedef __m512i vec;
+
+  static vec load(const uint16_t* p) { return _mm512_loadu_si512(p); }
+  static void store(uint16_t* p, vec v) { _mm512_storeu_si512(p, v); }
+  static vec set1(uint16_t c) { return _mm512_set1_epi16(static_cast<short>(c)); }
+  static vec adds(vec a, vec b) { return _mm512_adds_epu16(a, b); }
+  static vec min(vec a, vec b) { return _mm512_min_epu16(a, b); }
+  static vec mismatch(vec a, vec b, vec c) { return _mm512_maskz_mov_epi16(_mm512_cmpneq_epi16_mask(a, b), c); }
+};
+typedef batch_lanes_avx512 batch_lanes_default;
+#elif defined(__AVX2__)
+typedef batch_lanes_avx2 batch_lanes_default;
+#else
+typedef batch_lanes_portable batch_lanes_default;
+#endif
+
+/// \brief Batched edit distance with EditDistanceWF costs ([S, D, I],
+/// deletions consume the first sequence of a pair).
+template <typename _LanesT = batch_lanes_default, typename CostType = size_t>
+class BatchEditDistance {
+public:
+  typedef std::vector<CostType> CostVector;
+  static constexpr size_t W = _LanesT::width;
+
+  BatchEditDistance(CostVector costs = {1, 1, 1})
+    : costs_vector {costs} { }
+
+  static constexpr size_t lanes() { return W; }
+
+  /// \brief Writes the distance of every pair of [first, last) to out.
+  /// Pairs expose \c first and \c second sequences with size() and
+  /// operator[] (e.g., std::pair<std::string, std::string>).
+  template <typename _PairIterT, typename _OutIterT>
+  _OutIterT
+  operator()(_PairIterT first, _PairIterT last, _OutIterT out) {
+    std::vector<typename std::iterator_traits<_PairIterT>::pointer> batch;
+    batch.reserve(W);
+    std::vector<CostType> res(W);
+    for (; first != last; ++first) {
+      auto& p = *first;
+      if (fits(p.first.size(), p.second.size())) {
+        batch.push_back(&p);
+      } else {
+        // scores may not fit 16 bits, flush to keep the output order
+        out = flush(batch, res, out);
+        *out++ = scalar(p.first, p.second);
+      }
+      if (batch.size() == W) {
+        out = flush(batch, res, out);
+      }
+    }
+    return flush(batch, res, out);
+  }
+
+  template <typename _PairContT>
+  std::vector<CostType>
+  operator()(const _PairContT& pairs) {
+    std::vector<CostType> out;
+    out.reserve(pairs.size());
+    (*this)(std::begin(pairs), std::end(pairs), std::back_inserter(out));
+    return out;
+  }
+
+private:
+  CostVector costs_vector;
+  std::vector<uint16_t> ta, tb, row, tmp;
+
+  bool
+  fits(size_t n, size_t m) const {
+    CostType c = std::max(costs_vector[0], std::max(costs_vector[1], costs_vector[2]));
+    return (n + m + 1) * c < 0xffff;
+  }
+
+  template <typename _PtrT, typename _OutIterT>
+  _OutIterT
+  flush(std::vector<_PtrT>& batch, std::vector<CostType>& res, _OutIterT out) {
+    if (batch.empty()) {
+      return out;
+    }
+    run(batch, res);
+    for (size_t k = 0; k < batch.size(); ++k) {
+      *out++ = res[k];
+    }
+    batch.clear();
+    return out;
+  }
+
+  // transposes the batch and runs the recurrence row by row, the score
+  // of lane k is taken from row n_k at column m_k
+  template <typename _PtrT>
+  void
+  run(const std::vector<_PtrT>& batch, std::vector<CostType>& res) {
+    typedef typename _LanesT::vec vec;
+    size_t n = 0, m = 0;
+    for (auto p : batch) {
+      n = std::max<size_t>(n, p->first.size());
+      m = std::max<size_t>(m, p->second.size());
+    }
+    ta.assign(n * W, 0);
+    tb.assign(m * W, 0);
+    for (size_t k = 0; k < batch.size(); ++k) {
+      const auto& a = batch[k]->first;
+      const auto& b = batch[k]->second;
+      for (size_t i = 0; i < a.size(); ++i) {
+        ta[i * W + k] = static_cast<unsigned char>(a[i]);
+      }
+      for (size_t j = 0; j < b.size(); ++j) {
+        tb[j * W + k] = static_cast<unsigned char>(b[j]);
+      }
+    }
+    const uint16_t cs = static_cast<uint16_t>(costs_vector[0]);
+    const uint16_t cd = static_cast<uint16_t>(costs_vector[1]);
+    const uint16_t ci = static_cast<uint16_t>(costs_vector[2]);
+    const vec vs = _LanesT::set1(cs), vd = _LanesT::set1(cd), vi = _LanesT::set1(ci);
+    row.assign((m + 1) * W, 0);
+    for (size_t j = 1; j <= m; ++j) {
+      _LanesT::store(&row[j * W], _LanesT::set1(static_cast<uint16_t>(j * ci)));
+    }
+    tmp.resize(W);
+    auto collect = [&](size_t i) {
+      for (size_t k = 0; k < batch.size(); ++k) {
+        if (batch[k]->first.size() == i) {
+          res[k] = row[batch[k]->second.size() * W + k];
+        }
+      }
+    };
+    collect(0);
+    for (size_t i = 1; i <= n; ++i) {
+      const vec a = _LanesT::load(&ta[(i - 1) * W]);
+      vec diag = _LanesT::load(&row[0]);
+      vec left = _LanesT::adds(diag, vd);
+      _LanesT::store(&row[0], left);
+      for (size_t j = 1; j <= m; ++j) {
+        const vec up = _LanesT::load(&row[j * W]);
+        const vec b = _LanesT::load(&tb[(j - 1) * W]);
+        vec s = _LanesT::adds(diag, _LanesT::mismatch(a, b, vs));
+        vec d = _LanesT::adds(up, vd);
+        vec c = _LanesT::adds(left, vi);
+        left = _LanesT::min(s, _LanesT::min(d, c));
+        _LanesT::store(&row[j * W], left);
+        diag = up;
+      }
+      collect(i);
+    }
+  }
+
+  template <typename _SeqT1, typename _SeqT2>
+  CostType
+  scalar(const _SeqT1& a, const _SeqT2& b) const {
+    std::vector<CostType> r(b.size() + 1);
+    for (size_t j = 1; j <= b.size(); ++j) {
+      r[j] = r[j - 1] + costs_vector[2];
+    }
+    for (size_t i = 1; i <= a.size(); ++i) {
+      CostType diag = r[0];
+      r[0] += costs_vector[1];
+      for (size_t j = 1; j <= b.size(); ++j) {
+        CostType up = r[j];
+        r[j] = std::min(diag + ((a[i - 1] == b[j - 1]) ? 0 : costs_vector[0]),
+                        std::min(up + costs_vector[1], r[j - 1] + costs_vector[2]));
+        diag = up;
+      }
+    }
+    return r[b.size()];
+  }
+};
+
+template <typename CostType = size_t>
+BatchEditDistance<batch_lanes_default, CostType>
+make_batch_edit_distance() {
+  return BatchEditDistance<batch_lanes_default, CostType>({1, 1, 1});
+}
+
+CTL_DEFAULT_NAMESPACE_END
+
+#endif
@@ -16,10 +16,15 @@
 
 #include "../ctl.h"
 #include "../data_structure/matrix.hpp"
+#include "../iterator/circular_iterator.hpp"
+#include "../util/instrument.hpp"
 
 #include <vector>
 #include <cstdlib>
 #include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <limits>
 
 #ifndef _CTL_STR_DISTANCE_
 #define _CTL_STR_DISTANCE_
@@ -126,8 +131,10 @@ public:
   CostType
   operator()(IterT b1, IterT e1, IterT b2, IterT e2)
   {
+    CTL_INSTRUMENT_SCOPE("edit_distance_wf");
     size_t n = std::distance(b1, e1);
     size_t m = std::distance(b2, e2);
+    CTL_INSTRUMENT_COUNT("edit_distance_wf_cells", n * m);
     for (size_t i = 1; i <= n; ++i) {
       for (size_t j = 1; j <= m; ++j) {
 	CostType delta = (*(b1+i-1) == *(b2+j-1)) ? 0 : costs_vector[iS_];
@@ -145,8 +152,10 @@ public:
   CostType
   operator()(const IndexedType& s1, const IndexedType& s2)
   {
+    CTL_INSTRUMENT_SCOPE("edit_distance_wf");
     size_t n = s1.size();
     size_t m = s2.size();
+    CTL_INSTRUMENT_COUNT("edit_distance_wf_cells", n * m);
     for (size_t i = 1; i <= n; ++i) {
       for(size_t j = 1; j <= m; ++j) {
 	CostType delta = ( s1[i-1] == s2[j-1] ) ? 0 : costs_vector[iS_];
@@ -304,8 +313,10 @@ public:
     template<typename IterT>
     CostType
     operator()(IterT b1, IterT e1, IterT b2, IterT e2) {
+        CTL_INSTRUMENT_SCOPE("edit_distance_band");
         size_t n = std::distance(b1, e1);
         size_t m = std::distance(b2, e2);
+        CTL_INSTRUMENT_ONLY(uint64_t cells = 0;)
 
         // initialization is done here rather than in the constructor
         // because needed at each calculation (i.e., vectors will contain
@@ -326,6 +337,7 @@ public:
             // casts are necessary to cope with negative
             size_t j_min = std::max<int>(1, static_cast<int>(i - bandwidth));
             size_t j_max = std::min<int>(m, i + bandwidth);
+            CTL_INSTRUMENT_ONLY(cells += (j_max >= j_min) ? j_max - j_min + 1 : 0;)
             for (size_t j = j_min; j <= j_max; ++j) {
                 //CostType delta{(s1[i - 1] == s2[j - 1]) ? 0 : costs_vector[iS_]};
                 CostType delta = (*(b1 + i - 1) == *(b2 + j - 1)) ? 0 : costs_vector[iS_];
@@ -337,6 +349,8 @@ public:
             // swap the two vectors
            dp_struct.swap_rows(0, 1);
         }
+        CTL_INSTRUMENT_COUNT("edit_distance_band_cells", cells);
+        CTL_INSTRUMENT_COUNT("edit_distance_band_cells_skipped", n * m - cells);
         return dp_struct(0, m);
     }
 
@@ -386,6 +400,198 @@ EditDistanceBandApproxLinSpace<CostT> make_band_linear_alg(size_t n, size_t m, s
 }
 
 
+/// \brief Cyclic edit distance: the minimum over all rotations of the
+/// first string of the edit distance to the second one (e.g., for
+/// circular genomes). Uses Maes' divide and conquer over the grid of
+/// A.A (accessed through a circular_iterator) against B: the optimal
+/// paths from (k, 0) to (k+m, n) can be taken non-crossing, so the
+/// path of the middle rotation is searched only between the paths of
+/// the two rotations bounding it, giving O(mn log m) time instead of
+/// O(m^2 n). Costs follow EditDistanceWF ([S, D, I], deletions consume
+/// the first string). The traceback uses one byte per visited cell, at
+/// most (m+1)(n+1) for the first (unbounded) rotation.
+template<typename CostType = size_t>
+class CyclicEditDistance {
+public:
+  typedef std::vector<CostType> CostVector;
+
+private:
+  // for each column j of the path the first and last row visited
+  struct Path {
+    std::vector<size_t> first;
+    std::vector<size_t> last;
+    CostType cost;
+  };
+
+  CostVector costs_vector;
+  std::vector<uint8_t> trace;
+  std::vector<size_t> offset;
+  std::vector<CostType> prev, curr;
+  size_t best_rotation;
+
+  // shortest path from (k, 0) to (k+m, n) within rows
+  // [max(k, lo.first[j]), min(k+m, hi.last[j])] of each column
+  template <typename CircT, typename IterT>
+  Path
+  shortest_path(CircT a, IterT b2, size_t m, size_t n, size_t k,
+                const Path& lo, const Path& hi)
+  {
+    const CostType cS = costs_vector[iS_];
+    const CostType cD = costs_vector[iD_];
+    const CostType cI = costs_vector[iI_];
+    const CostType Inf = std::numeric_limits<CostType>::max() / 2;
+    std::vector<size_t> rlo(n + 1), rhi(n + 1);
+    offset.resize(n + 2);
+    offset[0] = 0;
+    for (size_t j = 0; j <= n; ++j) {
+      rlo[j] = std::max(k, lo.first[j]);
+      rhi[j] = std::min(k + m, hi.last[j]);
+      offset[j + 1] = offset[j] + (rhi[j] - rlo[j] + 1);
+    }
+    if (trace.size() < offset[n + 1]) {
+      trace.resize(offset[n + 1]);
+    }
+    // column 0: only deletions from (k, 0)
+    prev.assign(rhi[0] - rlo[0] + 1, Inf);
+    prev[0] = 0;
+    trace[offset[0]] = 0;
+    for (size_t i = rlo[0] + 1; i <= rhi[0]; ++i) {
+      prev[i - rlo[0]] = prev[i - 1 - rlo[0]] + cD;
+      trace[offset[0] + i - rlo[0]] = 1;
+    }
+    for (size_t j = 1; j <= n; ++j) {
+      const size_t plo = rlo[j - 1], phi = rhi[j - 1];
+      const size_t clo = rlo[j], chi = rhi[j];
+      curr.assign(chi - clo + 1, Inf);
+      uint8_t* t = &trace[offset[j]];
+      const auto bj = *(b2 + (j - 1));
+      CircT ai = a + static_cast<typename CircT::difference_type>(clo);
+      for (size_t i = clo; i <= chi; ++i, ++ai) {
+        CostType best = Inf;
+        uint8_t move = 0;
+        // diagonal from (i-1, j-1), row i-1 of A.A is *(ai - 1)
+        if (i > plo && i - 1 <= phi) {
+          CostType delta = (*(ai - 1) == bj) ? 0 : cS;
+          best = prev[i - 1 - plo] + delta;
+          move = 0;
+        }
+        // deletion from (i-1, j)
+        if (i > clo && curr[i - 1 - clo] + cD < best) {
+          best = curr[i - 1 - clo] + cD;
+          move = 1;
+        }
+        // insertion from (i, j-1)
+        if (i >= plo && i <= phi && prev[i - plo] + cI < best) {
+          best = prev[i - plo] + cI;
+          move = 2;
+        }
+        curr[i - clo] = best;
+        t[i - clo] = move;
+      }
+      prev.swap(curr);
+    }
+    Path p;
+    p.first.assign(n + 1, 0);
+    p.last.assign(n + 1, 0);
+    p.cost = prev[k + m - rlo[n]];
+    size_t i = k + m, j = n;
+    p.last[n] = i;
+    p.first[n] = i;
+    while (j > 0 || i > k) {
+      uint8_t move = trace[offset[j] + i - rlo[j]];
+      if (j == 0) {
+        move = 1;
+      }
+      if (move == 1) {
+        --i;
+        p.first[j] = i;
+      } else {
+        if (move == 0) {
+          --i;
+        }
+        --j;
+        p.last[j] = i;
+        p.first[j] = i;
+      }
+    }
+    return p;
+  }
+
+  template <typename CircT, typename IterT>
+  void
+  divide(CircT a, IterT b2, size_t m, size_t n, size_t klo, size_t khi,
+         const Path& lo, const Path& hi, CostType& best)
+  {
+    if (khi - klo <= 1) {
+      return;
+    }
+    size_t mid = klo + (khi - klo) / 2;
+    Path p = shortest_path(a, b2, m, n, mid, lo, hi);
+    if (p.cost < best) {
+      best = p.cost;
+      best_rotation = mid;
+    }
+    divide(a, b2, m, n, klo, mid, lo, p, best);
+    divide(a, b2, m, n, mid, khi, p, hi, best);
+  }
+
+public:
+  CyclicEditDistance(CostVector costs)
+    : costs_vector {costs}, best_rotation {0} { }
+
+  // Notes: IterT must be random iterator
+  template <typename IterT>
+  CostType
+  operator()(IterT b1, IterT e1, IterT b2, IterT e2)
+  {
+    const size_t m = std::distance(b1, e1);
+    const size_t n = std::distance(b2, e2);
+    best_rotation = 0;
+    if (m == 0) {
+      return n * costs_vector[iI_];
+    }
+    if (n == 0) {
+      return m * costs_vector[iD_];
+    }
+    auto a = make_circular_iterator(b1, m);
+    Path all;
+    all.first.assign(n + 1, 0);
+    all.last.assign(n + 1, 2 * m);
+    Path p0 = shortest_path(a, b2, m, n, 0, all, all);
+    // rotation m is rotation 0 shifted down by m rows
+    Path pm = p0;
+    for (size_t j = 0; j <= n; ++j) {
+      pm.first[j] += m;
+      pm.last[j] += m;
+    }
+    CostType best = p0.cost;
+    divide(a, b2, m, n, 0, m, p0, pm, best);
+    return best;
+  }
+
+  // Notes: IndexedType must have begin() and end() random iterators
+  template <typename IndexedType>
+  CostType
+  operator()(const IndexedType& s1, const IndexedType& s2)
+  {
+    return (*this)(s1.begin(), s1.end(), s2.begin(), s2.end());
+  }
+
+  /// \brief Rotation of the first string (number of characters moved
+  /// from the front to the back) attaining the last computed distance
+  size_t
+  rotation() const
+  {
+    return best_rotation;
+  }
+}; // CyclicEditDistance
+
+template <typename T = size_t>
+CyclicEditDistance<T> make_cyclic_alg()
+{
+  return CyclicEditDistance<T>({1, 1, 1});
+}
+
 CTL_DEFAULT_NAMESPACE_END
 
 #endif
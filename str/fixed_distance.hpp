@@ -0,0 +1,244 @@
+// str/fixed_distance.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file fixed_distance.hpp \brief Distance kernels for sequences whose
+/// length is a compile-time constant (barcodes, UMIs).
+///
+/// Sequences are either std::array<char, N> or fixed_view<N> (N chars
+/// stored elsewhere). The kernels use only stack arrays sized by the
+/// template arguments, so loops have constant trip counts that the
+/// compiler unrolls, nothing is allocated and every function is
+/// constexpr (e.g., to fill lookup tables at compile time).
+
+#include "../ctl.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifndef _CTL_STR_FIXED_DISTANCE_
+#define _CTL_STR_FIXED_DISTANCE_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+/// \brief Non-owning view of exactly N characters
+template <size_t N>
+class fixed_view
+{
+public:
+  typedef char value_type;
+  typedef const char* const_iterator;
+
+  constexpr fixed_view() : _p {nullptr} { }
+  constexpr explicit fixed_view(const char* p) : _p {p} { }
+  constexpr fixed_view(const std::array<char, N>& a) : _p {a.data()} { }
+
+  static constexpr size_t size() { return N; }
+  constexpr char operator[](size_t i) const { return _p[i]; }
+  constexpr const char* data() const { return _p; }
+  constexpr const_iterator begin() const { return _p; }
+  constexpr const_iterator end() const { return _p + N; }
+
+  std::string str() const { return std::string(_p, N); }
+
+private:
+  const char* _p;
+};
+
+/// \brief View of the N characters of s starting at pos (s must hold
+/// at least pos + N characters)
+template <size_t N>
+fixed_view<N>
+make_fixed_view(const std::string& s, size_t pos = 0) {
+  return fixed_view<N>(s.data() + pos);
+}
+
+/// \brief Copy of N characters starting at p
+template <size_t N>
+constexpr std::array<char, N>
+make_fixed_array(const char* p) {
+  std::array<char, N> a {};
+  for (size_t i = 0; i < N; ++i) {
+    a[i] = p[i];
+  }
+  return a;
+}
+
+template <typename T> struct fixed_length;
+template <size_t N> struct fixed_length<std::array<char, N>> { static constexpr size_t value = N; };
+template <size_t N> struct fixed_length<fixed_view<N>> { static constexpr size_t value = N; };
+
+/// \brief Hamming distance of two sequences of the same fixed length
+template <typename _SeqA, typename _SeqB, typename _IntT = size_t>
+constexpr _IntT
+hamming_distance_fixed(const _SeqA& a, const _SeqB& b) {
+  constexpr size_t N = fixed_length<_SeqA>::value;
+  static_assert(N == fixed_length<_SeqB>::value, "hamming distance needs equal lengths");
+  _IntT c {0};
+  for (size_t i = 0; i < N; ++i) {
+    c += (a[i] != b[i]) ? 1 : 0;
+  }
+  return c;
+}
+
+/// \brief Wagner and Fischer edit distance on fixed lengths with a
+/// single DP row kept on the stack. Costs are those of EditDistanceWF
+/// (deletions consume a, insertions consume b).
+template <typename CostType = size_t, typename _SeqA, typename _SeqB>
+constexpr CostType
+edit_distance_fixed(const _SeqA& a, const _SeqB& b, CostType cs = 1,
+                    CostType cd = 1, CostType ci = 1) {
+  constexpr size_t N = fixed_length<_SeqA>::value;
+  constexpr size_t M = fixed_length<_SeqB>::value;
+  std::array<CostType, M + 1> row {};
+  for (size_t j = 1; j <= M; ++j) {
+    row[j] = row[j - 1] + ci;
+  }
+  for (size_t i = 1; i <= N; ++i) {
+    CostType diag = row[0];
+    row[0] = row[0] + cd;
+    for (size_t j = 1; j <= M; ++j) {
+      CostType up = row[j];
+      CostType s = diag + ((a[i - 1] == b[j - 1]) ? 0 : cs);
+      CostType d = up + cd;
+      CostType ins = row[j - 1] + ci;
+      CostType best = (s < d) ? s : d;
+      row[j] = (best < ins) ? best : ins;
+      diag = up;
+    }
+  }
+  return row[M];
+}
+
+/// \brief Unit cost edit distance with Myers' bit-parallel algorithm
+/// (global variant by Hyyro): one 64 bit word per column of b, a must
+/// have at most 64 characters.
+template <typename CostType = size_t, typename _SeqA, typename _SeqB>
+constexpr CostType
+edit_distance_myers(const _SeqA& a, const _SeqB& b) {
+  constexpr size_t N = fixed_length<_SeqA>::value;
+  constexpr size_t M = fixed_length<_SeqB>::value;
+  static_assert(N <= 64, "Myers' kernel needs the first sequence to fit a word");
+  if constexpr (N == 0) {
+    return static_cast<CostType>(M);
+  } else {
+    // match masks of the distinct symbols of a
+    std::array<char, N> sym {};
+    std::array<uint64_t, N> peq {};
+    size_t k = 0;
+    for (size_t i = 0; i < N; ++i) {
+      size_t s = 0;
+      while (s < k && sym[s] != a[i]) {
+        ++s;
+      }
+      if (s == k) {
+        sym[k++] = a[i];
+      }
+      peq[s] |= uint64_t(1) << i;
+    }
+    const uint64_t mask = (N == 64) ? ~uint64_t(0) : ((uint64_t(1) << N) - 1);
+    const uint64_t high = uint64_t(1) << (N - 1);
+    uint64_t pv = mask, mv = 0;
+    CostType score = static_cast<CostType>(N);
+    for (size_t j = 0; j < M; ++j) {
+      uint64_t eq = 0;
+      for (size_t s = 0; s < k; ++s) {
+        eq = (sym[s] == b[j]) ? peq[s] : eq;
+      }
+      uint64_t xv = eq | mv;
+      uint64_t xh = ((((eq & pv) + pv) & mask) ^ pv) | eq;
+      uint64_t ph = mv | (~(xh | pv) & mask);
+      uint64_t mh = pv & xh;
+      if (ph & high) {
+        ++score;
+      } else if (mh & high) {
+        --score;
+      }
+      // the top row grows by one per column (global alignment)
+      ph = ((ph << 1) | 1) & mask;
+      mh = (mh << 1) & mask;
+      pv = mh | (~(xv | ph) & mask);
+      mv = ph & xv;
+    }
+    return score;
+  }
+}
+
+/// \brief Functor counterpart of the kernels for fixed lengths N and M,
+/// uses Myers' algorithm for unit costs when N <= 64.
+template <size_t N, size_t M = N, typename CostType = size_t>
+class FixedEditDistance {
+public:
+  constexpr FixedEditDistance(CostType cs = 1, CostType cd = 1, CostType ci = 1)
+    : _cs {cs}, _cd {cd}, _ci {ci} { }
+
+  template <typename _SeqA, typename _SeqB,
+            size_t = fixed_length<_SeqA>::value, size_t = fixed_length<_SeqB>::value>
+  constexpr CostType
+  operator()(const _SeqA& a, const _SeqB& b) const {
+    static_assert(fixed_length<_SeqA>::value == N && fixed_length<_SeqB>::value == M,
+                  "sequence lengths do not match the kernel");
+    if constexpr (N <= 64) {
+      if (_cs == 1 && _cd == 1 && _ci == 1) {
+        return edit_distance_myers<CostType>(a, b);
+      }
+    }
+    return edit_distance_fixed<CostType>(a, b, _cs, _cd, _ci);
+  }
+
+  constexpr CostType
+  operator()(const char* a, const char* b) const {
+    return (*this)(fixed_view<N>(a), fixed_view<M>(b));
+  }
+
+private:
+  CostType _cs;
+  CostType _cd;
+  CostType _ci;
+};
+
+template <size_t N, size_t M = N, typename CostType = size_t>
+constexpr FixedEditDistance<N, M, CostType>
+make_fixed_edit_distance() {
+  return FixedEditDistance<N, M, CostType>();
+}
+
+// the kernels must stay usable in constant expressions
+namespace fixed_distance_detail {
+
+constexpr std::array<char, 4> acgt = make_fixed_array<4>("ACGT");
+constexpr std::array<char, 4> aggt = make_fixed_array<4>("AGGT");
+constexpr std::array<char, 5> acggt = make_fixed_array<5>("ACGGT");
+constexpr fixed_view<6> acgtac("ACGTAC");
+constexpr fixed_view<6> cgtaca("CGTACA");
+
+static_assert(hamming_distance_fixed(acgt, aggt) == 1, "hamming_distance_fixed");
+static_assert(hamming_distance_fixed(acgtac, cgtaca) == 6, "hamming_distance_fixed");
+static_assert(edit_distance_fixed(acgt, acggt) == 1, "edit_distance_fixed");
+static_assert(edit_distance_fixed(acgtac, cgtaca) == 2, "edit_distance_fixed");
+static_assert(edit_distance_fixed<size_t>(acgt, aggt, 3, 1, 1) == 2, "edit_distance_fixed costs");
+static_assert(edit_distance_myers(acgt, acggt) == 1, "edit_distance_myers");
+static_assert(edit_distance_myers(acgtac, cgtaca) == 2, "edit_distance_myers");
+static_assert(FixedEditDistance<4, 5>()(acgt, acggt) == 1, "FixedEditDistance");
+static_assert(FixedEditDistance<6>()("ACGTAC", "CGTACA") == 2, "FixedEditDistance");
+static_assert(FixedEditDistance<4>(3, 1, 1)(acgt, aggt) == 2, "FixedEditDistance costs");
+
+} // namespace fixed_distance_detail
+
+CTL_DEFAULT_NAMESPACE_END
+
+#endif
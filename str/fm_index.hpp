@@ -0,0 +1,576 @@
+// str/fm_index.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file fm_index.hpp \brief Suffix array (SA-IS) construction and an
+/// FM-index over DNA for exact substring count and locate queries.
+///
+/// The FM-index works on the 2-bit codes of str/nucleotide.hpp; any
+/// character outside ACGT (e.g., N) is indexed as A, so a pattern made
+/// of As may report occurrences inside N runs. Patterns containing non
+/// ACGT characters never match. Positions are 32 bits wide, the text
+/// must be shorter than 2^32 - 1 characters.
+
+#include "../ctl.h"
+#include "../io/mapped_file.hpp"
+#include "../str/nucleotide.hpp"
+#include "../thread/thread_pool.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _CTL_STR_FM_INDEX_
+#define _CTL_STR_FM_INDEX_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+namespace sais_detail {
+
+constexpr uint32_t empty = std::numeric_limits<uint32_t>::max();
+
+template <typename _CharT>
+void
+buckets(const _CharT* s, size_t n, size_t K, std::vector<uint32_t>& bkt, bool end) {
+  bkt.assign(K, 0);
+  for (size_t i = 0; i < n; ++i) {
+    ++bkt[s[i]];
+  }
+  uint32_t sum = 0;
+  for (size_t c = 0; c < K; ++c) {
+    sum += bkt[c];
+    bkt[c] = end ? sum : sum - bkt[c];
+  }
+}
+
+// s[n-1] must be the unique smallest symbol, values in [0, K)
+template <typename _CharT>
+void
+sais(const _CharT* s, uint32_t* SA, size_t n, size_t K) {
+  if (n == 1) {
+    SA[0] = 0;
+    return;
+  }
+  std::vector<uint8_t> t(n, 0);
+  t[n - 1] = 1;
+  for (size_t i = n - 1; i-- > 0;) {
+    t[i] = (s[i] < s[i + 1] || (s[i] == s[i + 1] && t[i + 1])) ? 1 : 0;
+  }
+  auto lms = [&](size_t i) { return i > 0 && t[i] && !t[i - 1]; };
+  std::vector<uint32_t> bkt;
+  auto induce = [&]() {
+    buckets(s, n, K, bkt, false);
+    for (size_t i = 0; i < n; ++i) {
+      if (SA[i] != empty && SA[i] > 0 && !t[SA[i] - 1]) {
+        uint32_t j = SA[i] - 1;
+        SA[bkt[s[j]]++] = j;
+      }
+    }
+    buckets(s, n, K, bkt, true);
+    for (size_t i = n; i-- > 0;) {
+      if (SA[i] != empty && SA[i] > 0 && t[SA[i] - 1]) {
+        uint32_t j = SA[i] - 1;
+        SA[--bkt[s[j]]] = j;
+      }
+    }
+  };
+
+  // sort the LMS substrings
+  std::fill(SA, SA + n, empty);
+  buckets(s, n, K, bkt, true);
+  for (size_t i = 1; i < n; ++i) {
+    if (lms(i)) {
+      SA[--bkt[s[i]]] = static_cast<uint32_t>(i);
+    }
+  }
+  induce();
+
+  size_t n1 = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (lms(SA[i])) {
+      SA[n1++] = SA[i];
+    }
+  }
+  // name them, names are stored at SA[n1 + pos / 2]
+  std::fill(SA + n1, SA + n, empty);
+  uint32_t name = 0;
+  size_t prev = n;
+  for (size_t i = 0; i < n1; ++i) {
+    size_t pos = SA[i];
+    bool diff = (prev == n);
+    for (size_t d = 0; !diff; ++d) {
+      if (s[pos + d] != s[prev + d] || t[pos + d] != t[prev + d]) {
+        diff = true;
+      } else if (d > 0 && (lms(pos + d) || lms(prev + d))) {
+        break;
+      }
+    }
+    if (diff) {
+      ++name;
+      prev = pos;
+    }
+    SA[n1 + pos / 2] = name - 1;
+  }
+  for (size_t i = n, j = n; i-- > n1;) {
+    if (SA[i] != empty) {
+      SA[--j] = SA[i];
+    }
+  }
+
+  // sort the reduced string (recursively if names are not unique)
+  uint32_t* s1 = SA + n - n1;
+  if (name < n1) {
+    sais(static_cast<const uint32_t*>(s1), SA, n1, name);
+  } else {
+    for (size_t i = 0; i < n1; ++i) {
+      SA[s1[i]] = static_cast<uint32_t>(i);
+    }
+  }
+
+  // induce the final order from the sorted LMS suffixes
+  for (size_t i = 1, j = 0; i < n; ++i) {
+    if (lms(i)) {
+      s1[j++] = static_cast<uint32_t>(i);
+    }
+  }
+  for (size_t i = 0; i < n1; ++i) {
+    SA[i] = s1[SA[i]];
+  }
+  std::fill(SA + n1, SA + n, empty);
+  buckets(s, n, K, bkt, true);
+  for (size_t i = n1; i-- > 0;) {
+    uint32_t j = SA[i];
+    SA[i] = empty;
+    SA[--bkt[s[j]]] = j;
+  }
+  induce();
+}
+
+} // namespace sais_detail
+
+/// \brief Suffix array of the characters in [b, e) (compared as
+/// unsigned bytes) built with SA-IS in O(n) time.
+template <typename _IterT>
+std::vector<uint32_t>
+suffix_array(_IterT b, _IterT e) {
+  size_t n = std::distance(b, e);
+  if (n >= sais_detail::empty - 1) {
+    throw std::length_error("suffix_array: text longer than 2^32 - 2");
+  }
+  // shift by one to make room for the sentinel
+  std::vector<uint16_t> s(n + 1);
+  size_t i = 0;
+  for (; b != e; ++b, ++i) {
+    s[i] = static_cast<uint16_t>(static_cast<unsigned char>(*b)) + 1;
+  }
+  s[n] = 0;
+  std::vector<uint32_t> sa(n + 1);
+  sais_detail::sais(s.data(), sa.data(), n + 1, 257);
+  sa.erase(sa.begin());
+  return sa;
+}
+
+inline std::vector<uint32_t>
+suffix_array(const std::string& text) {
+  return suffix_array(text.begin(), text.end());
+}
+
+/// \brief One cache line of the occurrence table: the number of each
+/// base before the block followed by 192 BWT symbols at 2 bits each.
+struct alignas(64) fm_occ_block
+{
+  static constexpr size_t bases = 192;
+  uint32_t count[4];
+  uint64_t bits[6];
+};
+
+/// \brief FM-index over a DNA text with a sampled suffix array.
+///
+/// Every SA row whose text position is a multiple of the sample rate is
+/// kept, so locate needs at most <tt>sample_rate - 1</tt> LF steps per
+/// occurrence. The index can be saved to a file and loaded back with
+/// mmap, in which case the tables are used directly from the mapping.
+class fm_index
+{
+public:
+  typedef uint64_t size_type;
+
+  fm_index() { clear(); }
+
+  fm_index(const fm_index&) = delete;
+  fm_index& operator=(const fm_index&) = delete;
+  fm_index(fm_index&& o) noexcept { clear(); *this = std::move(o); }
+
+  fm_index&
+  operator=(fm_index&& o) noexcept {
+    _file = std::move(o._file);
+    _blocks_v = std::move(o._blocks_v);
+    _samples_v = std::move(o._samples_v);
+    _marks_v = std::move(o._marks_v);
+    _ranks_v = std::move(o._ranks_v);
+    _h = o._h;
+    _blocks = o._blocks;
+    _samples = o._samples;
+    _marks = o._marks;
+    _ranks = o._ranks;
+    o.clear();
+    return *this;
+  }
+
+  /// \brief Builds the index of [b, e), tables are filled on a thread
+  /// pool of \c n_threads threads (0 for the hardware concurrency).
+  template <typename _IterT>
+  static fm_index
+  build(_IterT b, _IterT e, uint32_t sample_rate = 32, size_t n_threads = 0) {
+    size_t n = std::distance(b, e);
+    if (n >= sais_detail::empty - 1) {
+      throw std::length_error("fm_index: text longer than 2^32 - 2");
+    }
+    if (sample_rate == 0) {
+      sample_rate = 1;
+    }
+    fm_index idx;
+    header& h = idx._h;
+    h.n = n;
+    h.rows = n + 1;
+    h.sample_rate = sample_rate;
+
+    // text codes shifted by one, 0 is the sentinel
+    std::vector<uint8_t> s(n + 1);
+    uint64_t freq[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; b != e; ++b, ++i) {
+      uint8_t c = nucleotide_code(*b);
+      c = (c == nucleotide_invalid) ? 0 : c;
+      ++freq[c];
+      s[i] = c + 1;
+    }
+    s[n] = 0;
+    std::vector<uint32_t> sa(n + 1);
+    sais_detail::sais(s.data(), sa.data(), n + 1, 5);
+
+    h.C[0] = 1;
+    for (int c = 1; c <= 4; ++c) {
+      h.C[c] = h.C[c - 1] + freq[c - 1];
+    }
+    for (size_t r = 0; r < h.rows; ++r) {
+      if (sa[r] == 0) {
+        h.dollar_row = r;
+        break;
+      }
+    }
+
+    thread_pool pool(n_threads);
+    const size_t B = fm_occ_block::bases;
+    h.n_blocks = h.rows / B + 1;
+    idx._blocks_v.assign(h.n_blocks, fm_occ_block());
+    fm_occ_block* blocks = idx._blocks_v.data();
+    // BWT symbols and per block counts ($ is stored as A)
+    parallel_for(pool, h.n_blocks, [&](size_t blk) {
+      fm_occ_block& ob = blocks[blk];
+      std::memset(&ob, 0, sizeof(ob));
+      size_t lo = blk * B, hi = std::min<size_t>(h.rows, lo + B);
+      for (size_t r = lo; r < hi; ++r) {
+        uint32_t p = sa[r];
+        uint64_t c = (p == 0) ? 0 : s[p - 1] - 1;
+        ob.bits[(r - lo) / 32] |= c << (2 * ((r - lo) % 32));
+        ++ob.count[c];
+      }
+    }, 64);
+    uint32_t run[4] = {0, 0, 0, 0};
+    for (size_t blk = 0; blk < h.n_blocks; ++blk) {
+      for (int c = 0; c < 4; ++c) {
+        uint32_t k = blocks[blk].count[c];
+        blocks[blk].count[c] = run[c];
+        run[c] += k;
+      }
+    }
+
+    // marks of sampled rows with the rank of each mark word
+    h.n_mark_words = h.rows / 64 + 1;
+    idx._marks_v.assign(h.n_mark_words, 0);
+    idx._ranks_v.assign(h.n_mark_words, 0);
+    uint64_t* marks = idx._marks_v.data();
+    parallel_for(pool, h.n_mark_words, [&](size_t w) {
+      size_t lo = w * 64, hi = std::min<size_t>(h.rows, lo + 64);
+      uint64_t m = 0;
+      for (size_t r = lo; r < hi; ++r) {
+        if (sa[r] % sample_rate == 0) {
+          m |= uint64_t(1) << (r - lo);
+        }
+      }
+      marks[w] = m;
+    }, 1024);
+    uint32_t acc = 0;
+    for (size_t w = 0; w < h.n_mark_words; ++w) {
+      idx._ranks_v[w] = acc;
+      acc += static_cast<uint32_t>(__builtin_popcountll(marks[w]));
+    }
+    h.n_samples = acc;
+    idx._samples_v.resize(acc);
+    parallel_for(pool, h.n_mark_words, [&](size_t w) {
+      uint32_t k = idx._ranks_v[w];
+      for (uint64_t m = marks[w]; m; m &= m - 1) {
+        idx._samples_v[k++] = sa[w * 64 + __builtin_ctzll(m)];
+      }
+    }, 1024);
+    idx.attach();
+    return idx;
+  }
+
+  static fm_index
+  build(const std::string& text, uint32_t sample_rate = 32, size_t n_threads = 0) {
+    return build(text.begin(), text.end(), sample_rate, n_threads);
+  }
+
+  /// \brief Length of the indexed text
+  size_type size() const { return _h.n; }
+  uint32_t sample_rate() const { return static_cast<uint32_t>(_h.sample_rate); }
+
+  /// \brief Number of occurrences of \c c in the first \c i BWT symbols
+  size_type
+  occ(uint8_t c, size_type i) const {
+    const fm_occ_block& ob = _blocks[i / fm_occ_block::bases];
+    size_type r = i % fm_occ_block::bases;
+    size_type k = ob.count[c];
+    const uint64_t pat = uint64_t(c) * 0x5555555555555555ULL;
+    size_t w = 0;
+    for (; r >= 32; r -= 32, ++w) {
+      k += match_count(ob.bits[w], pat, ~uint64_t(0));
+    }
+    if (r > 0) {
+      k += match_count(ob.bits[w], pat, (uint64_t(1) << (2 * r)) - 1);
+    }
+    // the sentinel is stored as an A
+    if (c == 0 && i > _h.dollar_row) {
+      --k;
+    }
+    return k;
+  }
+
+  /// \brief BWT symbol code at row \c i (the sentinel row reads as A)
+  uint8_t
+  bwt_code(size_type i) const {
+    const fm_occ_block& ob = _blocks[i / fm_occ_block::bases];
+    size_type r = i % fm_occ_block::bases;
+    return static_cast<uint8_t>((ob.bits[r / 32] >> (2 * (r % 32))) & 3);
+  }
+
+  /// \brief Suffix array interval [first, second) of the pattern
+  template <typename _IterT>
+  std::pair<size_type, size_type>
+  range(_IterT b, _IterT e) const {
+    size_type sp = 0, ep = _h.rows;
+    while (e != b && sp < ep) {
+      --e;
+      uint8_t c = nucleotide_code(*e);
+      if (c == nucleotide_invalid) {
+        return {0, 0};
+      }
+      sp = _h.C[c] + occ(c, sp);
+      ep = _h.C[c] + occ(c, ep);
+    }
+    return (sp < ep) ? std::make_pair(sp, ep) : std::make_pair(size_type(0), size_type(0));
+  }
+
+  std::pair<size_type, size_type>
+  range(const std::string& p) const {
+    return range(p.begin(), p.end());
+  }
+
+  size_type
+  count(const std::string& p) const {
+    auto r = range(p);
+    return r.second - r.first;
+  }
+
+  /// \brief Text position of the suffix at row \c r
+  size_type
+  locate_row(size_type r) const {
+    size_type steps = 0;
+    while (!((_marks[r / 64] >> (r % 64)) & 1)) {
+      uint8_t c = bwt_code(r);
+      r = _h.C[c] + occ(c, r);
+      ++steps;
+    }
+    uint64_t below = _marks[r / 64] & ((uint64_t(1) << (r % 64)) - 1);
+    size_type k = _ranks[r / 64] + __builtin_popcountll(below);
+    return _samples[k] + steps;
+  }
+
+  /// \brief Positions of (at most \c max) occurrences of the pattern,
+  /// in suffix array order
+  std::vector<size_type>
+  locate(const std::string& p, size_type max = std::numeric_limits<size_type>::max()) const {
+    auto r = range(p);
+    std::vector<size_type> out;
+    size_type last = r.first + std::min(max, r.second - r.first);
+    out.reserve(last - r.first);
+    for (size_type i = r.first; i < last; ++i) {
+      out.push_back(locate_row(i));
+    }
+    return out;
+  }
+
+  /// \brief Writes the index (tables are 64 byte aligned in the file)
+  void
+  save(const std::string& path) const {
+    std::ofstream os(path, std::ios::binary);
+    if (!os) {
+      throw std::runtime_error("fm_index: cannot write " + path);
+    }
+    static const char zeros[64] = {0};
+    os.write(reinterpret_cast<const char*>(&_h), sizeof(header));
+    auto put = [&](const void* p, size_t bytes) {
+      os.write(static_cast<const char*>(p), bytes);
+      os.write(zeros, (64 - bytes % 64) % 64);
+    };
+    put(_blocks, _h.n_blocks * sizeof(fm_occ_block));
+    put(_marks, _h.n_mark_words * sizeof(uint64_t));
+    put(_ranks, _h.n_mark_words * sizeof(uint32_t));
+    put(_samples, _h.n_samples * sizeof(uint32_t));
+    if (!os) {
+      throw std::runtime_error("fm_index: error writing " + path);
+    }
+  }
+
+  /// \brief Maps an index written by save(), nothing is copied
+  static fm_index
+  load(const std::string& path) {
+    fm_index idx;
+    idx._file.open(path);
+    const char* d = idx._file.data();
+    if (idx._file.size() < sizeof(header) || std::memcmp(d, "CTLFMI01", 8) != 0) {
+      throw std::runtime_error("fm_index: " + path + " is not an index");
+    }
+    std::memcpy(&idx._h, d, sizeof(header));
+    const header& h = idx._h;
+    auto corrupt = [&path]() {
+      return std::runtime_error("fm_index: " + path + " is corrupted");
+    };
+    // the table sizes are derived from n and sample_rate as in build(),
+    // which also keeps the arithmetic below far from overflowing
+    if (h.n >= sais_detail::empty - 1 || h.rows != h.n + 1 || h.sample_rate == 0
+        || h.dollar_row >= h.rows
+        || h.n_blocks != h.rows / fm_occ_block::bases + 1
+        || h.n_mark_words != h.rows / 64 + 1
+        || h.n_samples != h.n / h.sample_rate + 1) {
+      throw corrupt();
+    }
+    if (h.C[0] != 1 || h.C[4] != h.rows) {
+      throw corrupt();
+    }
+    for (int c = 1; c <= 4; ++c) {
+      if (h.C[c] < h.C[c - 1]) {
+        throw corrupt();
+      }
+    }
+    auto padded = [](uint64_t bytes) { return bytes + (64 - bytes % 64) % 64; };
+    uint64_t off = sizeof(header);
+    uint64_t need = off + padded(h.n_blocks * sizeof(fm_occ_block))
+      + padded(h.n_mark_words * sizeof(uint64_t)) + padded(h.n_mark_words * sizeof(uint32_t))
+      + padded(h.n_samples * sizeof(uint32_t));
+    if (idx._file.size() < need) {
+      throw std::runtime_error("fm_index: " + path + " is truncated");
+    }
+    idx._blocks = reinterpret_cast<const fm_occ_block*>(d + off);
+    off += padded(h.n_blocks * sizeof(fm_occ_block));
+    idx._marks = reinterpret_cast<const uint64_t*>(d + off);
+    off += padded(h.n_mark_words * sizeof(uint64_t));
+    idx._ranks = reinterpret_cast<const uint32_t*>(d + off);
+    off += padded(h.n_mark_words * sizeof(uint32_t));
+    idx._samples = reinterpret_cast<const uint32_t*>(d + off);
+    // locate indexes the samples through the mark ranks
+    uint64_t acc = 0;
+    for (uint64_t w = 0; w < h.n_mark_words; ++w) {
+      if (idx._ranks[w] != acc) {
+        throw corrupt();
+      }
+      acc += __builtin_popcountll(idx._marks[w]);
+    }
+    if (acc != h.n_samples) {
+      throw corrupt();
+    }
+    return idx;
+  }
+
+private:
+  // file header, padded to a cache line multiple
+  struct header
+  {
+    char magic[8];
+    uint64_t n;
+    uint64_t rows;
+    uint64_t dollar_row;
+    uint64_t sample_rate;
+    uint64_t n_blocks;
+    uint64_t n_mark_words;
+    uint64_t n_samples;
+    uint64_t C[5];
+    uint64_t reserved[3];
+  };
+  static_assert(sizeof(header) % 64 == 0, "fm_index header must be 64 byte aligned");
+
+  header _h;
+  mapped_file _file;
+  std::vector<fm_occ_block> _blocks_v;
+  std::vector<uint32_t> _samples_v;
+  std::vector<uint64_t> _marks_v;
+  std::vector<uint32_t> _ranks_v;
+  const fm_occ_block* _blocks;
+  const uint32_t* _samples;
+  const uint64_t* _marks;
+  const uint32_t* _ranks;
+
+  static size_type
+  match_count(uint64_t word, uint64_t pat, uint64_t mask) {
+    uint64_t x = word ^ pat;
+    uint64_t m = ~(x | (x >> 1)) & 0x5555555555555555ULL & mask;
+    return __builtin_popcountll(m);
+  }
+
+  void
+  clear() {
+    std::memset(&_h, 0, sizeof(_h));
+    std::memcpy(_h.magic, "CTLFMI01", 8);
+    _blocks = nullptr;
+    _samples = nullptr;
+    _marks = nullptr;
+    _ranks = nullptr;
+  }
+
+  void
+  attach() {
+    _blocks = _blocks_v.data();
+    _samples = _samples_v.data();
+    _marks = _marks_v.data();
+    _ranks = _ranks_v.data();
+  }
+};
+
+inline fm_index
+make_fm_index(const std::string& text, uint32_t sample_rate = 32, size_t n_threads = 0) {
+  return fm_index::build(text, sample_rate, n_threads);
+}
+
+CTL_DEFAULT_NAMESPACE_END
+
+#endif
@@ -15,6 +15,13 @@
 // limitations under the License.
 
 #include "../ctl.h"
+#include "nucleotide.hpp"
+#include "../util/instrument.hpp"
+
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <vector>
 
 #ifndef _CTL_STR_KMER_
 #define _CTL_STR_KMER_
@@ -32,13 +39,60 @@ kmer_statistics(const SeqT_& seq, size_t k, MapT_& map_, bool overlap = true)
   if (k < 1 || k > n) {
     return;
   }
+  CTL_INSTRUMENT_SCOPE("kmer_statistics");
+  CTL_INSTRUMENT_ONLY(const size_t distinct = map_.size(); uint64_t probes = 0;)
   std::advance(iter, k);
   while(iter != end) {
     auto key = SeqT_(begin , iter);
     map_[key]++;
+    CTL_INSTRUMENT_ONLY(++probes;)
     ++begin;
     ++iter;
   }
+  CTL_INSTRUMENT_COUNT("kmer_hash_probes", probes);
+  CTL_INSTRUMENT_COUNT("kmer_inserted", map_.size() - distinct);
+}
+
+/// \brief Calls f(code, i) for every k-mer starting at position i of
+/// [b, e) made only of A, C, G, T (case insensitive). The code packs 2
+/// bits per base with the first base in the most significant position,
+/// k must be in [1, 32].
+template <typename _IterT, typename _FunT>
+void
+for_each_kmer_code(_IterT b, _IterT e, size_t k, _FunT f)
+{
+  if (k < 1 || k > 32) {
+    return;
+  }
+  const uint64_t mask = (k == 32) ? ~uint64_t(0) : ((uint64_t(1) << (2 * k)) - 1);
+  uint64_t code = 0;
+  size_t valid = 0;
+  for (size_t i = 0; b != e; ++b, ++i) {
+    uint8_t c = nucleotide_code(*b);
+    if (c == nucleotide_invalid) {
+      valid = 0;
+      continue;
+    }
+    code = ((code << 2) | c) & mask;
+    if (++valid >= k) {
+      f(code, i + 1 - k);
+    }
+  }
+}
+
+/// \brief Integer counterpart of kmer_statistics: counts[code] is
+/// incremented for every ACGT k-mer, counts is resized to 4^k if
+/// needed (hence k should be small).
+template <typename SeqT_ = std::string, typename _CountT>
+void
+kmer_code_statistics(const SeqT_& seq, size_t k, std::vector<_CountT>& counts)
+{
+  const size_t n_codes = size_t(1) << (2 * k);
+  if (counts.size() < n_codes) {
+    counts.resize(n_codes, 0);
+  }
+  for_each_kmer_code(seq.begin(), seq.end(), k,
+                     [&counts](uint64_t code, size_t) { counts[code]++; });
 }
 
 CTL_DEFAULT_NAMESPACE_END
@@ -0,0 +1,67 @@
+// str/nucleotide.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file nucleotide.hpp \brief 2 bit nucleotide codes shared by packed
+/// containers and integer k-mer code (A=0, C=1, G=2, T=3).
+
+#include "../ctl.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#ifndef _CTL_STR_NUCLEOTIDE_
+#define _CTL_STR_NUCLEOTIDE_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+/// \brief Code returned for characters that are not (case insensitive)
+/// A, C, G or T.
+inline constexpr uint8_t nucleotide_invalid = 4;
+
+constexpr std::array<uint8_t, 256>
+make_nucleotide_table() {
+  std::array<uint8_t, 256> t {};
+  for (size_t i = 0; i < 256; ++i) {
+    t[i] = nucleotide_invalid;
+  }
+  t['A'] = t['a'] = 0;
+  t['C'] = t['c'] = 1;
+  t['G'] = t['g'] = 2;
+  t['T'] = t['t'] = 3;
+  return t;
+}
+
+inline constexpr std::array<uint8_t, 256> nucleotide_table = make_nucleotide_table();
+
+constexpr uint8_t
+nucleotide_code(char c) {
+  return nucleotide_table[static_cast<uint8_t>(c)];
+}
+
+constexpr char
+nucleotide_char(uint8_t code) {
+  return "ACGT"[code & 3];
+}
+
+constexpr uint8_t
+complement_code(uint8_t code) {
+  return 3 - code;
+}
+
+CTL_DEFAULT_NAMESPACE_END
+
+#endif
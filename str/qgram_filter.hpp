@@ -0,0 +1,215 @@
+// str/qgram_filter.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file qgram_filter.hpp \brief q-gram lemma filter in front of the
+/// (unit cost) edit distance.
+///
+/// If ed(x, y) <= k then x and y share at least
+/// <tt>max(|x|, |y|) - q + 1 - k q</tt> q-grams (counted with
+/// multiplicity), so a candidate sharing fewer cannot be within k and
+/// the DP can be skipped. The profile of the query (counts of its ACGT
+/// q-grams, see for_each_kmer_code) is computed once. A candidate is
+/// compared either by decrementing a copy of the query counts for each
+/// of its q-grams, or, when the profile is short compared to the
+/// candidate, through the L1 distance of the two dense count vectors
+/// (AVX2 when available). q-grams with non ACGT characters are not
+/// counted and the bound is lowered accordingly.
+
+#include "../ctl.h"
+#include "kmer.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#ifndef _CTL_STR_QGRAM_FILTER_
+#define _CTL_STR_QGRAM_FILTER_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+/// \brief Sum of |a[i] - b[i]| over n 16 bit counters
+inline uint64_t
+l1_distance(const uint16_t* a, const uint16_t* b, size_t n) {
+  uint64_t s = 0;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 16 <= n; i += 16) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    __m256i d = _mm256_or_si256(_mm256_subs_epu16(x, y), _mm256_subs_epu16(y, x));
+    // pairs of differences fit 32 bit lanes (madd is signed, so split
+    // the unsigned values in their halves)
+    __m256i lo = _mm256_and_si256(d, _mm256_set1_epi16(0x7fff));
+    __m256i hi = _mm256_srli_epi16(d, 15);
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, ones));
+    acc = _mm256_add_epi32(acc, _mm256_slli_epi32(_mm256_madd_epi16(hi, ones), 15));
+    if (((i / 16) & 0x3ff) == 0x3ff) {
+      uint32_t t[8];
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(t), acc);
+      for (auto v : t) {
+        s += v;
+      }
+      acc = _mm256_setzero_si256();
+    }
+  }
+  uint32_t t[8];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(t), acc);
+  for (auto v : t) {
+    s += v;
+  }
+#endif
+  for (; i < n; ++i) {
+    s += (a[i] > b[i]) ? a[i] - b[i] : b[i] - a[i];
+  }
+  return s;
+}
+
+/// \brief Reusable filter for a query and an edit distance threshold k.
+/// Not thread safe (it keeps scratch space and statistics), use one
+/// copy per thread.
+class qgram_filter
+{
+public:
+  struct statistics
+  {
+    size_t checked = 0;
+    size_t rejected = 0;
+  };
+
+  qgram_filter(const std::string& query, size_t q, size_t k)
+    : _q {q}, _k {k}, _n {query.size()}, _valid {0} {
+    if (q < 1 || q > 12) {
+      throw std::invalid_argument("qgram_filter: q must be in [1, 12]");
+    }
+    if (query.size() > 0xffff) {
+      throw std::invalid_argument("qgram_filter: query longer than 65535");
+    }
+    _profile.assign(size_t(1) << (2 * q), 0);
+    for_each_kmer_code(query.begin(), query.end(), q, [this](uint64_t c, size_t) {
+      ++_profile[c];
+      ++_valid;
+    });
+    _rem = _profile;
+  }
+
+  size_t q() const { return _q; }
+  size_t k() const { return _k; }
+  const std::vector<uint16_t>& profile() const { return _profile; }
+  const statistics& stats() const { return _stats; }
+  void reset_stats() { _stats = statistics(); }
+
+  /// \brief Minimum number of shared q-grams for a candidate of length
+  /// m to be within distance k (0 when the lemma gives no bound)
+  size_t
+  threshold(size_t m, size_t invalid) const {
+    size_t L = std::max(_n, m);
+    size_t lose = _k * _q + _q - 1 + invalid;
+    return (L > lose) ? L - lose : 0;
+  }
+
+  /// \brief Shared q-grams by decrementing the query counts, O(m)
+  template <typename _IterT>
+  size_t
+  shared_decrement(_IterT b, _IterT e) {
+    size_t shared = 0;
+    _touched.clear();
+    _last_valid = 0;
+    for_each_kmer_code(b, e, _q, [&](uint64_t c, size_t) {
+      ++_last_valid;
+      if (_rem[c] > 0) {
+        if (_rem[c] == _profile[c]) {
+          _touched.push_back(static_cast<uint32_t>(c));
+        }
+        --_rem[c];
+        ++shared;
+      }
+    });
+    for (uint32_t c : _touched) {
+      _rem[c] = _profile[c];
+    }
+    return shared;
+  }
+
+  /// \brief Shared q-grams from the L1 distance of dense profiles,
+  /// O(4^q) vectorized, the candidate must be shorter than 65536
+  template <typename _IterT>
+  size_t
+  shared_l1(_IterT b, _IterT e) {
+    _other.assign(_profile.size(), 0);
+    _last_valid = 0;
+    for_each_kmer_code(b, e, _q, [&](uint64_t c, size_t) {
+      ++_other[c];
+      ++_last_valid;
+    });
+    uint64_t d = l1_distance(_profile.data(), _other.data(), _profile.size());
+    // sum of min(x, y) = (sum x + sum y - sum |x - y|) / 2
+    return static_cast<size_t>((_valid + _last_valid - d) / 2);
+  }
+
+  /// \brief false when the candidate is certainly farther than k
+  template <typename _IterT>
+  bool
+  accept(_IterT b, _IterT e) {
+    const size_t m = std::distance(b, e);
+    ++_stats.checked;
+    // q-grams of either string containing non ACGT characters
+    size_t total = (m >= _q) ? m - _q + 1 : 0;
+    size_t query_total = (_n >= _q) ? _n - _q + 1 : 0;
+    size_t shared = (_profile.size() <= 2 * m && m <= 0xffff)
+      ? shared_l1(b, e) : shared_decrement(b, e);
+    size_t invalid = std::min(total - _last_valid, query_total - _valid);
+    if (shared < threshold(m, invalid)) {
+      ++_stats.rejected;
+      return false;
+    }
+    return true;
+  }
+
+  bool
+  accept(const std::string& y) {
+    return accept(y.begin(), y.end());
+  }
+
+private:
+  size_t _q;
+  size_t _k;
+  size_t _n;
+  size_t _valid;
+  size_t _last_valid = 0;
+  std::vector<uint16_t> _profile;
+  std::vector<uint16_t> _rem;
+  std::vector<uint16_t> _other;
+  std::vector<uint32_t> _touched;
+  statistics _stats;
+};
+
+inline qgram_filter
+make_qgram_filter(const std::string& query, size_t q, size_t k) {
+  return qgram_filter(query, q, k);
+}
+
+CTL_DEFAULT_NAMESPACE_END
+
+#endif
@@ -0,0 +1,336 @@
+// str/spectrum.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file spectrum.hpp \brief Exhaustive distribution of edit distances
+/// over Sigma^n: either all pairs (x, y) or all words against a
+/// reference.
+///
+/// For a fixed x the words y are enumerated in lexicographic order and
+/// the dynamic programming rows of y are shared with the previous word
+/// (only the rows from SigmaNIterator::changed() on are recomputed).
+/// All pairs can skip symmetric work: with \e swap only y >= x is
+/// computed, with \e permutation only x in canonical form (symbols in
+/// order of first occurrence) is computed and weighted by the size of
+/// its orbit under alphabet permutations. Work is split in units of
+/// words x that are processed on a thread pool; with a checkpoint path
+/// the completed units and the partial histogram are saved periodically
+/// and a run resumes from them.
+
+#include "../ctl.h"
+#include "../iterator/string_iterator.hpp"
+#include "../thread/thread_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _CTL_STR_SPECTRUM_
+#define _CTL_STR_SPECTRUM_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+enum class spectrum_symmetry { none, swap, permutation };
+
+struct spectrum_options
+{
+  size_t n_threads = 0;
+  spectrum_symmetry symmetry = spectrum_symmetry::permutation;
+  /// words x per task in all_pairs
+  size_t unit_size = 256;
+  /// words y per task in against (rounded up to a multiple of 64), 0
+  /// splits Sigma^n in about 256 tasks
+  size_t words_per_task = 0;
+  std::string checkpoint;
+  double checkpoint_seconds = 60.0;
+};
+
+template <typename CostType = size_t>
+class EditDistanceSpectrum {
+public:
+  typedef std::vector<CostType> CostVector;
+  typedef std::vector<uint64_t> Histogram;
+
+  EditDistanceSpectrum(size_t n, std::string Sigma, CostVector costs = {1, 1, 1})
+    : _n {n}, _sigma {Sigma}, _costs {costs} { }
+
+  /// \brief hist[d] is the number of ordered pairs (x, y) of Sigma^n
+  /// with edit distance d.
+  Histogram
+  all_pairs(const spectrum_options& opt = spectrum_options()) {
+    // a unit is a range of indices in the list of words x
+    std::vector<uint64_t> xs;
+    std::vector<uint64_t> weights;
+    if (opt.symmetry == spectrum_symmetry::permutation) {
+      canonical_words(xs, weights);
+    } else {
+      SigmaNIterator it(_n, _sigma);
+      xs.resize(it.size());
+      for (uint64_t i = 0; i < xs.size(); ++i) {
+        xs[i] = i;
+      }
+    }
+    bool swap = (opt.symmetry == spectrum_symmetry::swap);
+    return run(xs.size(), opt.unit_size, opt, [&](size_t i, Worker& w, Histogram& h) {
+      SigmaNIterator x(_n, _sigma);
+      x.seek(xs[i]);
+      uint64_t first = swap ? xs[i] : 0;
+      uint64_t weight = weights.empty() ? 1 : weights[i];
+      w.scan(x.digits(), first, x.size(), h, weight, swap ? xs[i] : x.size());
+    });
+  }
+
+  /// \brief hist[d] is the number of words y of Sigma^n with
+  /// EditDistanceWF(y, ref) = d (whose length may differ from n), i.e.
+  /// deletions remove characters of y and insertions add characters of
+  /// ref. The direction only matters when deletion and insertion costs
+  /// differ.
+  Histogram
+  against(const std::string& ref, const spectrum_options& opt = spectrum_options()) {
+    std::vector<uint8_t> r(ref.size());
+    for (size_t i = 0; i < ref.size(); ++i) {
+      size_t p = _sigma.find(ref[i]);
+      // characters outside Sigma never match
+      r[i] = (p == std::string::npos) ? 0xff : static_cast<uint8_t>(p);
+    }
+    SigmaNIterator it(_n, _sigma);
+    const uint64_t total = it.size();
+    // a unit is a block of 64 consecutive words y
+    const uint64_t unit_words = 64;
+    const size_t units = static_cast<size_t>((total + unit_words - 1) / unit_words);
+    const size_t per_task = (opt.words_per_task > 0)
+      ? static_cast<size_t>((opt.words_per_task + unit_words - 1) / unit_words)
+      : std::max<size_t>(1, (units + 255) / 256);
+    return run(units, per_task, opt, [&](size_t u, Worker& w, Histogram& h) {
+      uint64_t b = u * unit_words;
+      uint64_t e = std::min(total, b + unit_words);
+      w.scan(r, b, e, h, 1, total);
+    });
+  }
+
+private:
+  size_t _n;
+  std::string _sigma;
+  CostVector _costs;
+
+  // Per thread DP state, rows are indexed by the positions of y and
+  // columns by the positions of x.
+  class Worker {
+  public:
+    Worker(size_t n, const std::string& sigma, const CostVector& costs)
+      : _n {n}, _sigma {sigma}, _costs {costs} { }
+
+    void
+    scan(const std::vector<uint8_t>& x, uint64_t yb, uint64_t ye, Histogram& h,
+         uint64_t weight, uint64_t diagonal) {
+      const size_t m = x.size();
+      const CostType cs = _costs[0], cd = _costs[1], ci = _costs[2];
+      _dp.assign((_n + 1) * (m + 1), 0);
+      // y plays the role of the first string of EditDistanceWF
+      for (size_t j = 1; j <= m; ++j) {
+        _dp[j] = _dp[j - 1] + ci;
+      }
+      for (size_t i = 1; i <= _n; ++i) {
+        _dp[i * (m + 1)] = _dp[(i - 1) * (m + 1)] + cd;
+      }
+      SigmaNIterator y(_n, _sigma), yend(_n, _sigma);
+      y.seek(yb);
+      yend.seek(ye);
+      bool first = true;
+      for (; y != yend; ++y) {
+        size_t from = first ? 0 : y.changed();
+        first = false;
+        const std::vector<uint8_t>& yd = y.digits();
+        for (size_t i = from + 1; i <= _n; ++i) {
+          CostType* prev = &_dp[(i - 1) * (m + 1)];
+          CostType* cur = &_dp[i * (m + 1)];
+          const uint8_t c = yd[i - 1];
+          for (size_t j = 1; j <= m; ++j) {
+            CostType a = prev[j - 1] + ((c == x[j - 1]) ? 0 : cs);
+            CostType b = prev[j] + cd;
+            CostType d = cur[j - 1] + ci;
+            cur[j] = std::min(a, std::min(b, d));
+          }
+        }
+        size_t dist = static_cast<size_t>(_dp[_n * (m + 1) + m]);
+        if (dist >= h.size()) {
+          h.resize(dist + 1, 0);
+        }
+        // with swap symmetry pairs off the diagonal count twice
+        h[dist] += (diagonal < y.size() && y.rank() != diagonal) ? 2 * weight : weight;
+      }
+    }
+
+  private:
+    size_t _n;
+    const std::string& _sigma;
+    const CostVector& _costs;
+    std::vector<CostType> _dp;
+  };
+
+  // restricted growth strings of length n over at most |Sigma| symbols,
+  // weights are |Sigma|! / (|Sigma| - distinct)!
+  void
+  canonical_words(std::vector<uint64_t>& codes, std::vector<uint64_t>& weights) const {
+    const uint64_t k = _sigma.size();
+    std::vector<uint8_t> d(_n, 0);
+    std::function<void(size_t, uint64_t, uint8_t)> rec =
+      [&](size_t i, uint64_t code, uint8_t used) {
+        if (i == _n) {
+          uint64_t w = 1;
+          for (uint64_t t = 0; t < used; ++t) {
+            w *= (k - t);
+          }
+          codes.push_back(code);
+          weights.push_back(w);
+          return;
+        }
+        uint8_t lim = static_cast<uint8_t>(std::min<uint64_t>(used + 1, k));
+        for (uint8_t s = 0; s < lim; ++s) {
+          rec(i + 1, code * k + s, std::max<uint8_t>(used, s + 1));
+        }
+      };
+    if (_n == 0) {
+      codes.push_back(0);
+      weights.push_back(1);
+      return;
+    }
+    rec(0, 0, 0);
+  }
+
+  std::string
+  header(size_t units) const {
+    std::ostringstream os;
+    os << "ctl-spectrum 1 " << _n << " " << _sigma << " " << units;
+    for (auto c : _costs) {
+      os << " " << c;
+    }
+    return os.str();
+  }
+
+  template <typename _UnitF>
+  Histogram
+  run(size_t units, size_t per_task, const spectrum_options& opt, _UnitF unit) {
+    Histogram hist;
+    per_task = std::max<size_t>(1, per_task);
+    const size_t tasks = (units + per_task - 1) / per_task;
+    std::vector<char> task_done(tasks, 0);
+    const std::string head = header(units) + " " + std::to_string(per_task);
+    if (!opt.checkpoint.empty()) {
+      load_checkpoint(opt.checkpoint, head, task_done, hist);
+    }
+    std::mutex m;
+    auto save = [&]() {
+      if (opt.checkpoint.empty()) {
+        return;
+      }
+      std::string tmp = opt.checkpoint + ".tmp";
+      {
+        std::ofstream os(tmp);
+        os << head << "\n";
+        for (size_t t = 0; t < tasks; ++t) {
+          os << (task_done[t] ? '1' : '0');
+        }
+        os << "\n";
+        for (auto c : hist) {
+          os << c << " ";
+        }
+        os << "\n";
+      }
+      std::rename(tmp.c_str(), opt.checkpoint.c_str());
+    };
+
+    thread_pool pool(opt.n_threads);
+    std::vector<std::future<void>> fs;
+    auto last = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < tasks; ++t) {
+      if (task_done[t]) {
+        continue;
+      }
+      fs.push_back(pool.submit([&, t]() {
+        Worker w(_n, _sigma, _costs);
+        Histogram local;
+        for (size_t u = t * per_task; u < std::min(units, (t + 1) * per_task); ++u) {
+          unit(u, w, local);
+        }
+        std::lock_guard<std::mutex> lk(m);
+        if (local.size() > hist.size()) {
+          hist.resize(local.size(), 0);
+        }
+        for (size_t d = 0; d < local.size(); ++d) {
+          hist[d] += local[d];
+        }
+        task_done[t] = 1;
+      }));
+    }
+    for (auto& f : fs) {
+      while (f.wait_for(std::chrono::milliseconds(200)) != std::future_status::ready) {
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - last).count() >= opt.checkpoint_seconds) {
+          std::lock_guard<std::mutex> lk(m);
+          save();
+          last = now;
+        }
+      }
+      f.get();
+    }
+    save();
+    return hist;
+  }
+
+  static void
+  load_checkpoint(const std::string& path, const std::string& head,
+                  std::vector<char>& task_done, Histogram& hist) {
+    std::ifstream is(path);
+    if (!is) {
+      return;
+    }
+    std::string line;
+    std::getline(is, line);
+    if (line != head) {
+      throw std::runtime_error("spectrum: checkpoint " + path + " is for a different run");
+    }
+    std::getline(is, line);
+    if (line.size() != task_done.size()) {
+      throw std::runtime_error("spectrum: corrupted checkpoint " + path);
+    }
+    for (size_t t = 0; t < line.size(); ++t) {
+      task_done[t] = (line[t] == '1');
+    }
+    uint64_t c;
+    while (is >> c) {
+      hist.push_back(c);
+    }
+  }
+};
+
+template <typename CostType = size_t>
+EditDistanceSpectrum<CostType>
+make_edit_distance_spectrum(size_t n, std::string Sigma) {
+  return EditDistanceSpectrum<CostType>(n, Sigma, {1, 1, 1});
+}
+
+CTL_DEFAULT_NAMESPACE_END
+
+#endif
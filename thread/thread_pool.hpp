@@ -0,0 +1,163 @@
+// thread/thread_pool.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file thread_pool.hpp \brief Fixed size pool of worker threads
+/// executing tasks from a FIFO queue.
+
+#include "../ctl.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifndef _CTL_THREAD_POOL_
+#define _CTL_THREAD_POOL_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+class thread_pool
+{
+public:
+  /// \brief Starts n workers, 0 means hardware concurrency.
+  explicit thread_pool(size_t n = 0) : _stop {false} {
+    if (n == 0) {
+      n = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < n; ++i) {
+      _workers.emplace_back([this]() { work(); });
+    }
+  }
+
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  /// \brief Waits for the queued tasks to complete and joins.
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      _stop = true;
+    }
+    _cv.notify_all();
+    for (auto& w : _workers) {
+      w.join();
+    }
+  }
+
+  size_t size() const { return _workers.size(); }
+
+  /// \brief Queues f and returns a future to its result.
+  template <typename _FunT>
+  std::future<typename std::invoke_result<_FunT>::type>
+  submit(_FunT f) {
+    typedef typename std::invoke_result<_FunT>::type result_type;
+    auto task = std::make_shared<std::packaged_task<result_type()>>(std::move(f));
+    std::future<result_type> fut = task->get_future();
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      _queue.emplace_back([task]() { (*task)(); });
+    }
+    _cv.notify_one();
+    return fut;
+  }
+
+private:
+  std::vector<std::thread> _workers;
+  std::deque<std::function<void()>> _queue;
+  std::mutex _m;
+  std::condition_variable _cv;
+  bool _stop;
+
+  void
+  work() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lk(_m);
+        _cv.wait(lk, [this]() { return _stop || !_queue.empty(); });
+        if (_queue.empty()) {
+          return;
+        }
+        task = std::move(_queue.front());
+        _queue.pop_front();
+      }
+      task();
+    }
+  }
+};
+
+/// \brief Waits for every valid future of [b, e) without retrieving
+/// the results. Callers whose tasks reference their frame use it before
+/// unwinding, so that no task outlives the state it points to.
+template <typename _IterT>
+void
+wait_all(_IterT b, _IterT e) {
+  for (; b != e; ++b) {
+    if (b->valid()) {
+      b->wait();
+    }
+  }
+}
+
+/// \brief Waits for every future of [b, e), then retrieves them in
+/// order and rethrows the first exception.
+template <typename _IterT>
+void
+get_all(_IterT b, _IterT e) {
+  wait_all(b, e);
+  for (; b != e; ++b) {
+    if (b->valid()) {
+      b->get();
+    }
+  }
+}
+
+/// \brief Runs f(i) for i in [0, n) on the pool, split in contiguous
+/// ranges, and waits for completion. Every range completes before the
+/// first exception is rethrown.
+template <typename _FunT>
+void
+parallel_for(thread_pool& pool, size_t n, _FunT f, size_t grain = 1) {
+  size_t parts = std::min(pool.size() * 4, (n + grain - 1) / std::max<size_t>(1, grain));
+  if (parts <= 1) {
+    for (size_t i = 0; i < n; ++i) {
+      f(i);
+    }
+    return;
+  }
+  std::vector<std::future<void>> fs;
+  try {
+    for (size_t p = 0; p < parts; ++p) {
+      size_t b = n * p / parts, e = n * (p + 1) / parts;
+      fs.push_back(pool.submit([&f, b, e]() { for (size_t i = b; i < e; ++i) { f(i); } }));
+    }
+  } catch (...) {
+    wait_all(fs.begin(), fs.end());
+    throw;
+  }
+  get_all(fs.begin(), fs.end());
+}
+
+CTL_DEFAULT_NAMESPACE_END
+
+#endif
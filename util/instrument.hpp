@@ -0,0 +1,292 @@
+// util/instrument.hpp
+
+// Copyright 2022 Michele Schimd
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// \file instrument.hpp \brief Hot path counters and scoped timers.
+///
+/// Instrumentation points are written with the macros below and compile
+/// to nothing unless \c CTL_INSTRUMENTATION is defined before including
+/// any library header:
+///
+/// - <tt>CTL_INSTRUMENT_COUNT("name", n)</tt> adds n to a counter;
+/// - <tt>CTL_INSTRUMENT_SCOPE("name")</tt> times the enclosing scope;
+/// - <tt>CTL_INSTRUMENT_ONLY(stmt)</tt> keeps stmt only when enabled.
+///
+/// Every thread updates its own slots (single writer, relaxed atomics)
+/// and snapshot() sums the live threads and the threads that already
+/// exited. The snapshot can be exported as JSON or Prometheus text.
+
+#include "../ctl.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef _CTL_UTIL_INSTRUMENT_
+#define _CTL_UTIL_INSTRUMENT_
+
+CTL_DEFAULT_NAMESPACE_BEGIN
+
+namespace instrument {
+
+/// \brief Number of slots per thread, a timer takes two of them.
+/// Metrics registered past the limit share the last slot.
+constexpr size_t max_slots = 256;
+
+enum class metric_kind { counter, timer };
+
+struct metric
+{
+  std::string name;
+  metric_kind kind;
+  uint64_t value;   // counter value or number of timed scopes
+  uint64_t nanos;   // total time of a timer
+};
+
+struct thread_slots;
+
+class registry
+{
+public:
+  static registry&
+  instance() {
+    static registry r;
+    return r;
+  }
+
+  /// \brief Slot of the counter with the given name
+  size_t counter(const char* name) { return slot(name, metric_kind::counter); }
+  /// \brief First of the two slots (calls, nanoseconds) of a timer
+  size_t timer(const char* name) { return slot(name, metric_kind::timer); }
+
+  std::vector<metric> snapshot();
+  void reset();
+
+private:
+  friend struct thread_slots;
+
+  std::mutex _m;
+  std::vector<std::string> _names;
+  std::vector<metric_kind> _kinds;
+  std::vector<size_t> _slots;
+  size_t _used = 0;
+  std::vector<thread_slots*> _threads;
+  uint64_t _retired[max_slots] = {};
+
+  size_t
+  slot(const char* name, metric_kind k) {
+    std::lock_guard<std::mutex> lk(_m);
+    for (size_t i = 0; i < _names.size(); ++i) {
+      if (_names[i] == name && _kinds[i] == k) {
+        return _slots[i];
+      }
+    }
+    size_t need = (k == metric_kind::timer) ? 2 : 1;
+    size_t s = (_used + need <= max_slots) ? _used : max_slots - need;
+    _used = std::min(max_slots, _used + need);
+    _names.emplace_back(name);
+    _kinds.push_back(k);
+    _slots.push_back(s);
+    return s;
+  }
+};
+
+struct thread_slots
+{
+  std::atomic<uint64_t> v[max_slots];
+
+  thread_slots() {
+    for (auto& x : v) {
+      x.store(0, std::memory_order_relaxed);
+    }
+    registry& r = registry::instance();
+    std::lock_guard<std::mutex> lk(r._m);
+    r._threads.push_back(this);
+  }
+
+  ~thread_slots() {
+    registry& r = registry::instance();
+    std::lock_guard<std::mutex> lk(r._m);
+    for (size_t i = 0; i < max_slots; ++i) {
+      r._retired[i] += v[i].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < r._threads.size(); ++i) {
+      if (r._threads[i] == this) {
+        r._threads[i] = r._threads.back();
+        r._threads.pop_back();
+        break;
+      }
+    }
+  }
+};
+
+inline thread_slots&
+local() {
+  thread_local thread_slots s;
+  return s;
+}
+
+inline void
+add(size_t slot, uint64_t n) {
+  std::atomic<uint64_t>& a = local().v[slot];
+  a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+class scoped_timer
+{
+public:
+  explicit scoped_timer(size_t slot)
+    : _slot {slot}, _start {std::chrono::steady_clock::now()} { }
+
+  ~scoped_timer() {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - _start).count();
+    add(_slot, 1);
+    add(_slot + 1, static_cast<uint64_t>(ns));
+  }
+
+  scoped_timer(const scoped_timer&) = delete;
+  scoped_timer& operator=(const scoped_timer&) = delete;
+
+private:
+  size_t _slot;
+  std::chrono::steady_clock::time_point _start;
+};
+
+inline std::vector<metric>
+registry::snapshot() {
+  std::lock_guard<std::mutex> lk(_m);
+  std::vector<uint64_t> sum(_retired, _retired + max_slots);
+  for (thread_slots* t : _threads) {
+    for (size_t i = 0; i < _used; ++i) {
+      sum[i] += t->v[i].load(std::memory_order_relaxed);
+    }
+  }
+  std::vector<metric> out;
+  for (size_t i = 0; i < _names.size(); ++i) {
+    size_t s = _slots[i];
+    bool timer = (_kinds[i] == metric_kind::timer);
+    out.push_back(metric {_names[i], _kinds[i], sum[s], timer ? sum[s + 1] : 0});
+  }
+  return out;
+}
+
+/// \brief Zeroes every metric. Concurrent updates may survive the
+/// reset since the owning threads are not stopped.
+inline void
+registry::reset() {
+  std::lock_guard<std::mutex> lk(_m);
+  for (auto& x : _retired) {
+    x = 0;
+  }
+  for (thread_slots* t : _threads) {
+    for (auto& x : t->v) {
+      x.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+inline std::vector<metric>
+snapshot() {
+  return registry::instance().snapshot();
+}
+
+inline void
+reset() {
+  registry::instance().reset();
+}
+
+/// \brief {"counters": {name: value}, "timers": {name: {"calls": c,
+/// "seconds": s}}}
+inline std::string
+to_json(const std::vector<metric>& ms) {
+  std::string counters, timers;
+  for (const metric& m : ms) {
+    std::string& out = (m.kind == metric_kind::counter) ? counters : timers;
+    if (!out.empty()) {
+      out += ", ";
+    }
+    out += "\"" + m.name + "\": ";
+    if (m.kind == metric_kind::counter) {
+      out += std::to_string(m.value);
+    } else {
+      out += "{\"calls\": " + std::to_string(m.value)
+        + ", \"seconds\": " + std::to_string(m.nanos * 1e-9) + "}";
+    }
+  }
+  return "{\"counters\": {" + counters + "}, \"timers\": {" + timers + "}}";
+}
+
+/// \brief Prometheus text format, counters become \c prefix_name_total
+/// and timers \c prefix_name_calls_total and \c prefix_name_seconds_total
+inline std::string
+to_prometheus(const std::vector<metric>& ms, const std::string& prefix = "ctl") {
+  std::string out;
+  auto line = [&](const std::string& name, const std::string& value) {
+    out += "# TYPE " + name + " counter\n" + name + " " + value + "\n";
+  };
+  for (const metric& m : ms) {
+    std::string base = prefix.empty() ? m.name : prefix + "_" + m.name;
+    if (m.kind == metric_kind::counter) {
+      line(base + "_total", std::to_string(m.value));
+    } else {
+      line(base + "_calls_total", std::to_string(m.value));
+      line(base + "_seconds_total", std::to_string(m.nanos * 1e-9));
+    }
+  }
+  return out;
+}
+
+inline std::string to_json() { return to_json(snapshot()); }
+inline std::string to_prometheus(const std::string& prefix = "ctl") {
+  return to_prometheus(snapshot(), prefix);
+}
+
+} // namespace instrument
+
+CTL_DEFAULT_NAMESPACE_END
+
+#define CTL_INSTRUMENT_CAT2_(a, b) a##b
+#define CTL_INSTRUMENT_CAT_(a, b) CTL_INSTRUMENT_CAT2_(a, b)
+
+#ifdef CTL_INSTRUMENTATION
+
+#define CTL_INSTRUMENT_COUNT(name, n)                                   \
+  do {                                                                  \
+    static const size_t _ctl_slot =                                     \
+      ::ctl::instrument::registry::instance().counter(name);            \
+    ::ctl::instrument::add(_ctl_slot, static_cast<uint64_t>(n));        \
+  } while (0)
+
+#define CTL_INSTRUMENT_SCOPE(name)                                      \
+  static const size_t CTL_INSTRUMENT_CAT_(_ctl_tslot_, __LINE__) =      \
+    ::ctl::instrument::registry::instance().timer(name);                \
+  ::ctl::instrument::scoped_timer CTL_INSTRUMENT_CAT_(_ctl_timer_, __LINE__)( \
+    CTL_INSTRUMENT_CAT_(_ctl_tslot_, __LINE__))
+
+#define CTL_INSTRUMENT_ONLY(...) __VA_ARGS__
+
+#else
+
+#define CTL_INSTRUMENT_COUNT(name, n) do { } while (0)
+#define CTL_INSTRUMENT_SCOPE(name) do { } while (0)
+#define CTL_INSTRUMENT_ONLY(...)
+
+#endif
+
+#endif